@@ -42,6 +42,8 @@ typedef struct imap_server_conf {
 	char *pass;
 	char *pass_cmd;
 	int max_in_progress;
+	int failures; /* consecutive failures to open a store */
+	time_t retry_at; /* don't try again before this monotonic_time() */
 #ifdef HAVE_LIBSSL
 	unsigned require_ssl:1;
 	unsigned require_cram:1;
@@ -91,6 +93,7 @@ typedef struct imap_store {
 	char delimiter; /* hierarchy delimiter */
 	list_t *ns_personal, *ns_other, *ns_shared; /* NAMESPACE info */
 	message_t **msgapp; /* FETCH results */
+	message_t *sizemsg; /* RFC822.SIZE lookup cursor, see imap_load_p2() */
 	unsigned caps; /* CAPABILITY results */
 	parse_list_state_t parse_list_sts;
 	/* command queue */
@@ -125,6 +128,7 @@ struct imap_cmd {
 		int uid; /* to identify fetch responses */
 		unsigned
 			high_prio:1, /* if command is queued, put it at the front of the queue. */
+			search:1, /* collects SEARCH results. */
 			to_trash:1, /* we are storing to trash, not current. */
 			create:1, /* create the mailbox if we get an error ... */
 			trycreate:1; /* ... but only if this is true or the server says so. */
@@ -149,6 +153,12 @@ struct imap_cmd_out_uid {
 	int out_uid;
 };
 
+struct imap_cmd_copy_msg {
+	struct imap_cmd_out_uid gen;
+	store_t *dst;
+	int uidvalidity; /* from COPYUID */
+};
+
 struct imap_cmd_refcounted_state {
 	void (*callback)( int sts, void *aux );
 	void *callback_aux;
@@ -161,6 +171,13 @@ struct imap_cmd_refcounted {
 	struct imap_cmd_refcounted_state *state;
 };
 
+struct imap_cmd_search {
+	struct imap_cmd_refcounted gen;
+	int *uids; /* results */
+	int nuids, ruids;
+	int minuid, maxuid; /* searched range; ESEARCH ranges are clipped to it */
+};
+
 #define CAP(cap) (ctx->caps & (1 << (cap)))
 
 enum CAPABILITY {
@@ -171,7 +188,9 @@ enum CAPABILITY {
 #endif
 	UIDPLUS,
 	LITERALPLUS,
-	NAMESPACE
+	NAMESPACE,
+	ESEARCH,
+	GMAIL
 };
 
 static const char *cap_list[] = {
@@ -182,7 +201,9 @@ static const char *cap_list[] = {
 #endif
 	"UIDPLUS",
 	"LITERAL+",
-	"NAMESPACE"
+	"NAMESPACE",
+	"ESEARCH",
+	"X-GM-EXT-1"
 };
 
 #define RESP_OK       0
@@ -273,6 +294,7 @@ send_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd )
 	*ctx->in_progress_append = cmd;
 	ctx->in_progress_append = &cmd->next;
 	ctx->num_in_progress++;
+	socket_expect_read( &ctx->conn, 1 );
 	return 0;
 
   bail:
@@ -705,11 +727,11 @@ static int
 parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
 {
 	list_t *tmp, *flags;
-	char *body = 0, *tuid = 0;
+	char *body = 0, *tuid = 0, *msgid = 0;
 	imap_message_t *cur;
 	msg_data_t *msgdata;
 	struct imap_cmd *cmdp;
-	int uid = 0, mask = 0, status = 0, size = 0;
+	int uid = 0, mask = 0, status = 0, size = 0, gotsize = 0;
 	unsigned i;
 	time_t date = 0;
 	struct tm datetime;
@@ -765,10 +787,17 @@ parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
 					error( "IMAP error: unable to parse INTERNALDATE\n" );
 			} else if (!strcmp( "RFC822.SIZE", tmp->val )) {
 				tmp = tmp->next;
-				if (is_atom( tmp ))
+				if (is_atom( tmp )) {
 					size = atoi( tmp->val );
-				else
+					gotsize = 1;
+				} else
 					error( "IMAP error: unable to parse RFC822.SIZE\n" );
+			} else if (!strcmp( "X-GM-MSGID", tmp->val )) {
+				tmp = tmp->next;
+				if (is_atom( tmp ))
+					msgid = tmp->val;
+				else
+					error( "IMAP error: unable to parse X-GM-MSGID\n" );
 			} else if (!strcmp( "BODY[]", tmp->val )) {
 				tmp = tmp->next;
 				if (is_atom( tmp )) {
@@ -809,6 +838,21 @@ parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
 		msgdata->date = date;
 		if (status & M_FLAGS)
 			msgdata->flags = mask;
+	} else if (uid && ctx->sizemsg) {
+		/* Size of an already loaded message, see imap_load_p2().
+		 * The list is sorted and the replies usually come in order,
+		 * so this restarts from the head at most once.
+		 * Anything else (e.g., a flag update) is ignored. */
+		if (gotsize) {
+			message_t *msg = ctx->sizemsg;
+			if (msg->uid > uid)
+				msg = ctx->gen.msgs;
+			for (; msg && msg->uid < uid; msg = msg->next) {}
+			if (msg && msg->uid == uid) {
+				msg->size = size;
+				ctx->sizemsg = msg;
+			}
+		}
 	} else if (uid) { /* ignore async flag updates for now */
 		/* XXX this will need sorting for out-of-order (multiple queries) */
 		cur = nfcalloc( sizeof(*cur) );
@@ -824,6 +868,7 @@ parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
 			strncpy( cur->gen.tuid, tuid, TUIDL );
 		else
 			cur->gen.tuid[0] = 0;
+		cur->gen.msgid = msgid ? nfstrdup( msgid ) : 0;
 		if (ctx->gen.uidnext <= uid) /* in case the server sends no UIDNEXT */
 			ctx->gen.uidnext = uid + 1;
 	}
@@ -832,6 +877,98 @@ parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
 	return LIST_OK;
 }
 
+static struct imap_cmd_search *
+find_search_cmd( imap_store_t *ctx, int tag )
+{
+	struct imap_cmd *cmdp;
+
+	for (cmdp = ctx->in_progress; cmdp; cmdp = cmdp->next)
+		if (cmdp->param.search && (tag < 0 || cmdp->tag == tag))
+			return (struct imap_cmd_search *)cmdp;
+	return 0;
+}
+
+static void
+add_search_uid( struct imap_cmd_search *cmdp, int uid )
+{
+	if (cmdp->nuids == cmdp->ruids) {
+		cmdp->ruids = cmdp->ruids * 2 + 100;
+		cmdp->uids = nfrealloc( cmdp->uids, cmdp->ruids * sizeof(int) );
+	}
+	cmdp->uids[cmdp->nuids++] = uid;
+}
+
+static int
+parse_search_rsp( imap_store_t *ctx, char *cmd )
+{
+	struct imap_cmd_search *cmdp;
+	char *arg;
+
+	/* Plain SEARCH responses are not tagged, but the server won't run
+	 * our searches concurrently, so the oldest one gets the results. */
+	if (!(cmdp = find_search_cmd( ctx, -1 ))) {
+		error( "IMAP error: unexpected SEARCH response\n" );
+		return -1;
+	}
+	while ((arg = next_arg( &cmd )))
+		add_search_uid( cmdp, atoi( arg ) );
+	return 0;
+}
+
+static int
+parse_esearch_rsp( imap_store_t *ctx, char *cmd )
+{
+	struct imap_cmd_search *cmdp;
+	char *arg, *p;
+	long uid, uid2;
+	int tag;
+
+	if (!cmd || memcmp( cmd, "(TAG \"", 6 ) ||
+	    (tag = strtol( cmd + 6, &p, 10 ), memcmp( p, "\")", 2 )))
+		goto bad;
+	if (!(cmdp = find_search_cmd( ctx, tag ))) {
+		error( "IMAP error: unexpected ESEARCH response (tag %d)\n", tag );
+		return -1;
+	}
+	cmd = p + 2;
+	while ((arg = next_arg( &cmd ))) {
+		if (!strcmp( "UID", arg ))
+			continue;
+		if (!(p = next_arg( &cmd )))
+			goto bad;
+		if (strcmp( "ALL", arg ))
+			continue; /* we don't ask for MIN, MAX, etc. */
+		for (;;) {
+			uid2 = uid = strtol( p, &p, 10 );
+			if (*p == ':')
+				uid2 = strtol( p + 1, &p, 10 );
+			if (uid2 < uid) {
+				long tuid = uid;
+				uid = uid2;
+				uid2 = tuid;
+			}
+			if (uid <= 0 || uid2 > INT_MAX)
+				goto bad;
+			/* Ranges may span big UID gaps; expand only what we asked for. */
+			if (uid < cmdp->minuid)
+				uid = cmdp->minuid;
+			if (uid2 > cmdp->maxuid)
+				uid2 = cmdp->maxuid;
+			for (; uid <= uid2; uid++)
+				add_search_uid( cmdp, (int)uid );
+			if (!*p)
+				break;
+			if (*p++ != ',')
+				goto bad;
+		}
+	}
+	return 0;
+
+  bad:
+	error( "IMAP error: malformed ESEARCH response\n" );
+	return -1;
+}
+
 static void
 parse_capability( imap_store_t *ctx, char *cmd )
 {
@@ -845,6 +982,8 @@ parse_capability( imap_store_t *ctx, char *cmd )
 				ctx->caps |= 1 << i;
 }
 
+static void imap_copy_msg_p2( imap_store_t *, struct imap_cmd *, int );
+
 static int
 parse_response_code( imap_store_t *ctx, struct imap_cmd *cmd, char *s )
 {
@@ -879,6 +1018,15 @@ parse_response_code( imap_store_t *ctx, struct imap_cmd *cmd, char *s )
 		 */
 		for (; isspace( (unsigned char)*p ); p++);
 		error( "*** IMAP ALERT *** %s\n", p );
+	} else if (cmd && cmd->param.done == imap_copy_msg_p2 && !strcmp( "COPYUID", arg )) {
+		if (!(arg = next_arg( &s )) ||
+		    (((struct imap_cmd_copy_msg *)cmd)->uidvalidity = strtoll( arg, &earg, 10 ), *earg) ||
+		    !next_arg( &s ) || !(arg = next_arg( &s )) ||
+		    !(((struct imap_cmd_out_uid *)cmd)->out_uid = atoi( arg )))
+		{
+			error( "IMAP error: malformed COPYUID status\n" );
+			return RESP_CANCEL;
+		}
 	} else if (cmd && !strcmp( "APPENDUID", arg )) {
 		if (!(arg = next_arg( &s )) ||
 		    (ctx->gen.uidvalidity = strtoll( arg, &earg, 10 ), *earg) ||
@@ -1044,6 +1192,12 @@ imap_socket_read( void *aux )
 			} else if (!strcmp( "LIST", arg )) {
 				resp = parse_list( ctx, cmd, parse_list_rsp );
 				goto listret;
+			} else if (!strcmp( "SEARCH", arg )) {
+				if (parse_search_rsp( ctx, cmd ) < 0)
+					break;
+			} else if (!strcmp( "ESEARCH", arg )) {
+				if (parse_esearch_rsp( ctx, cmd ) < 0)
+					break;
 			} else if ((arg1 = next_arg( &cmd ))) {
 				if (!strcmp( "EXISTS", arg1 ))
 					ctx->gen.count = atoi( arg );
@@ -1058,6 +1212,7 @@ imap_socket_read( void *aux )
 				break; /* this may mean anything, so prefer not to spam the log */
 			}
 			if (greeted == GreetingPending) {
+				socket_expect_read( &ctx->conn, 0 );
 				imap_ref( ctx );
 				imap_open_store_greeted( ctx );
 				if (imap_deref( ctx ))
@@ -1097,7 +1252,8 @@ imap_socket_read( void *aux )
 		  gottag:
 			if (!(*pcmdp = cmdp->next))
 				ctx->in_progress_append = pcmdp;
-			ctx->num_in_progress--;
+			if (!--ctx->num_in_progress)
+				socket_expect_read( &ctx->conn, 0 );
 			arg = next_arg( &cmd );
 			if (!arg) {
 				error( "IMAP error: malformed tagged response\n" );
@@ -1204,7 +1360,7 @@ imap_invoke_bad_callback( imap_store_t *ctx )
 
 /******************* imap_disown_store & imap_own_store *******************/
 
-static store_t *unowned;
+static THREAD_LOCAL store_t *unowned;
 
 static void
 imap_cancel_unowned( void *gctx )
@@ -1310,8 +1466,17 @@ static void imap_open_store_finalize( imap_store_t * );
 #ifdef HAVE_LIBSSL
 static void imap_open_store_ssl_bail( imap_store_t * );
 #endif
+static void imap_open_store_fail( imap_store_t * );
 static void imap_open_store_bail( imap_store_t * );
 
+/* A server which could not be used is not contacted again for a while, so
+ * the remaining channels using it fail fast instead of each running into
+ * the same error or timeout. The pause grows with each failure in a row.
+ * Only failures to connect, to secure the connection and to log in count;
+ * whatever goes wrong later is specific to the mailbox or the channel. */
+#define RETRY_MIN 60 /* seconds */
+#define RETRY_MAX 3600
+
 static void
 imap_open_store( store_conf_t *conf,
                  void (*cb)( store_t *srv, void *aux ), void *aux )
@@ -1321,6 +1486,12 @@ imap_open_store( store_conf_t *conf,
 	imap_store_t *ctx;
 	store_t **ctxp;
 
+	if (srvc->failures && monotonic_time() < srvc->retry_at) {
+		error( "Skipping account %s due to earlier failure\n", srvc->name );
+		cb( 0, aux );
+		return;
+	}
+
 	for (ctxp = &unowned; (ctx = (imap_store_t *)*ctxp); ctxp = &ctx->gen.next)
 		if (((imap_store_conf_t *)ctx->gen.conf)->server == srvc) {
 			*ctxp = ctx->gen.next;
@@ -1343,7 +1514,7 @@ imap_open_store( store_conf_t *conf,
 	ctx->ref_count = 1;
 	ctx->callbacks.imap_open = cb;
 	ctx->callback_aux = aux;
-	set_bad_callback( &ctx->gen, (void (*)(void *))imap_open_store_bail, ctx );
+	set_bad_callback( &ctx->gen, (void (*)(void *))imap_open_store_fail, ctx );
 	ctx->in_progress_append = &ctx->in_progress;
 	ctx->pending_append = &ctx->pending;
 
@@ -1362,10 +1533,14 @@ imap_open_store_connected( int ok, void *aux )
 	imap_server_conf_t *srvc = cfg->server;
 #endif
 
-	if (!ok)
-		imap_open_store_bail( ctx );
+	if (!ok) {
+		imap_open_store_fail( ctx );
+		return;
+	}
+	/* The greeting is due, also when it comes only after the handshake. */
+	socket_expect_read( &ctx->conn, 1 );
 #ifdef HAVE_LIBSSL
-	else if (srvc->sconf.use_imaps)
+	if (srvc->sconf.use_imaps)
 		socket_start_tls( &ctx->conn, imap_open_store_tlsstarted1 );
 #endif
 }
@@ -1386,7 +1561,7 @@ imap_open_store_greeted( imap_store_t *ctx )
 {
 	if (ctx->greeting == GreetingBad) {
 		error( "IMAP error: unknown greeting response\n" );
-		imap_open_store_bail( ctx );
+		imap_open_store_fail( ctx );
 		return;
 	}
 
@@ -1400,7 +1575,7 @@ static void
 imap_open_store_p2( imap_store_t *ctx, struct imap_cmd *cmd ATTR_UNUSED, int response )
 {
 	if (response == RESP_NO)
-		imap_open_store_bail( ctx );
+		imap_open_store_fail( ctx );
 	else if (response == RESP_OK)
 		imap_open_store_authenticate( ctx );
 }
@@ -1422,7 +1597,7 @@ imap_open_store_authenticate( imap_store_t *ctx )
 			} else {
 				if (srvc->require_ssl) {
 					error( "IMAP error: SSL support not available\n" );
-					imap_open_store_bail( ctx );
+					imap_open_store_fail( ctx );
 					return;
 				} else {
 					warn( "IMAP warning: SSL support not available\n" );
@@ -1441,7 +1616,7 @@ static void
 imap_open_store_authenticate_p2( imap_store_t *ctx, struct imap_cmd *cmd ATTR_UNUSED, int response )
 {
 	if (response == RESP_NO)
-		imap_open_store_bail( ctx );
+		imap_open_store_fail( ctx );
 	else if (response == RESP_OK)
 		socket_start_tls( &ctx->conn, imap_open_store_tlsstarted2 );
 }
@@ -1461,7 +1636,7 @@ static void
 imap_open_store_authenticate_p3( imap_store_t *ctx, struct imap_cmd *cmd ATTR_UNUSED, int response )
 {
 	if (response == RESP_NO)
-		imap_open_store_bail( ctx );
+		imap_open_store_fail( ctx );
 	else if (response == RESP_OK)
 		imap_open_store_authenticate2( ctx );
 }
@@ -1536,12 +1711,12 @@ imap_open_store_authenticate2( imap_store_t *ctx )
 	}
 	if (srvc->require_cram) {
 		error( "IMAP error: CRAM-MD5 authentication is not supported by server\n" );
-		goto bail;
+		goto fail;
 	}
 #endif
 	if (CAP(NOLOGIN)) {
 		error( "Skipping account %s, server forbids LOGIN\n", srvc->name );
-		goto bail;
+		goto fail;
 	}
 #ifdef HAVE_LIBSSL
 	if (!ctx->conn.ssl)
@@ -1551,6 +1726,9 @@ imap_open_store_authenticate2( imap_store_t *ctx )
 	           "LOGIN \"%s\" \"%s\"", srvc->user, srvc->pass );
 	return;
 
+  fail:
+	imap_open_store_fail( ctx );
+	return;
   bail:
 	imap_open_store_bail( ctx );
 }
@@ -1559,7 +1737,7 @@ static void
 imap_open_store_authenticate2_p2( imap_store_t *ctx, struct imap_cmd *cmd ATTR_UNUSED, int response )
 {
 	if (response == RESP_NO)
-		imap_open_store_bail( ctx );
+		imap_open_store_fail( ctx );
 	else if (response == RESP_OK)
 		imap_open_store_namespace( ctx );
 }
@@ -1569,6 +1747,9 @@ imap_open_store_namespace( imap_store_t *ctx )
 {
 	imap_store_conf_t *cfg = (imap_store_conf_t *)ctx->gen.conf;
 
+	/* Logged in, so the server is fine. */
+	cfg->server->failures = 0;
+	set_bad_callback( &ctx->gen, (void (*)(void *))imap_open_store_bail, ctx );
 	ctx->prefix = cfg->gen.path;
 	ctx->delimiter = cfg->delimiter;
 	if (((!*ctx->prefix && cfg->use_namespace) || !cfg->delimiter) && CAP(NAMESPACE)) {
@@ -1627,15 +1808,30 @@ imap_open_store_ssl_bail( imap_store_t *ctx )
 {
 	/* This avoids that we try to send LOGOUT to an unusable socket. */
 	socket_close( &ctx->conn );
-	imap_open_store_bail( ctx );
+	imap_open_store_fail( ctx );
 }
 #endif
 
+static void
+imap_open_store_fail( imap_store_t *ctx )
+{
+	imap_server_conf_t *srvc = ((imap_store_conf_t *)ctx->gen.conf)->server;
+	int pause;
+
+	pause = RETRY_MIN << (srvc->failures < 6 ? srvc->failures : 6);
+	if (pause > RETRY_MAX)
+		pause = RETRY_MAX;
+	srvc->failures++;
+	srvc->retry_at = monotonic_time() + pause;
+	imap_open_store_bail( ctx );
+}
+
 static void
 imap_open_store_bail( imap_store_t *ctx )
 {
 	void (*cb)( store_t *srv, void *aux ) = ctx->callbacks.imap_open;
 	void *aux = ctx->callback_aux;
+
 	imap_cancel_store( &ctx->gen );
 	cb( 0, aux );
 }
@@ -1677,39 +1873,120 @@ imap_select( store_t *gctx, int create,
 
 /******************* imap_load *******************/
 
+/* Searches cover at most this many messages (or UIDs), so even an
+ * uncompacted result line fits into the socket's receive buffer. */
+#define SEARCH_WINDOW 7000
+
+struct imap_load_vars {
+	imap_store_t *ctx;
+	void (*callback)( int sts, void *aux );
+	void *callback_aux;
+	int *excs, nexcs; /* sorted */
+	int *large, nlarge; /* UIDs of messages above size_limit */
+	int *found, nfound; /* exceptions which still exist */
+	int searching; /* exception lookups in flight */
+};
+
 static int imap_submit_load( imap_store_t *, const char *, int, struct imap_cmd_refcounted_state * );
+static void imap_make_set( char *, int *, int, int *, int );
+static int imap_submit_load_ranges( imap_store_t *, int *, int, struct imap_cmd_refcounted_state * );
+static int imap_submit_search( imap_store_t *, const char *, int, int, struct imap_cmd_refcounted_state *,
+                               void (*)( imap_store_t *, struct imap_cmd *, int ) );
+static void imap_load_large_p2( imap_store_t *, struct imap_cmd *, int );
+static void imap_load_excs_p2( imap_store_t *, struct imap_cmd *, int );
+static void imap_load_p2( int, void * );
 
 static void
 imap_load( store_t *gctx, int minuid, int maxuid, int newuid, int *excs, int nexcs,
            void (*cb)( int sts, void *aux ), void *aux )
 {
 	imap_store_t *ctx = (imap_store_t *)gctx;
-	int i, j, bl;
+	struct imap_load_vars *vars;
+	struct imap_cmd_refcounted_state *sts;
+	int i, j, k, nrngs, *rngs;
 	char buf[1000];
 
 	if (!ctx->gen.count) {
 		free( excs );
 		cb( DRV_OK, aux );
 	} else {
-		struct imap_cmd_refcounted_state *sts = imap_refcounted_new_state( cb, aux );
+		vars = nfmalloc( sizeof(*vars) );
+		vars->ctx = ctx;
+		vars->callback = cb;
+		vars->callback_aux = aux;
+		vars->excs = excs;
+		vars->nexcs = nexcs;
+		vars->large = 0;
+		vars->nlarge = 0;
+		vars->found = 0;
+		vars->nfound = 0;
+		vars->searching = 0;
+		sts = imap_refcounted_new_state( imap_load_p2, vars );
 
 		ctx->msgapp = &ctx->gen.msgs;
+		if (maxuid == INT_MAX)
+			maxuid = ctx->gen.uidnext ? ctx->gen.uidnext - 1 : 1000000000;
+		/* Only sizes above the limit matter, and usually few messages have
+		 * such sizes - so ask the server for them instead of fetching all.
+		 * ESEARCH results are compact; plain SEARCH results are windowed by
+		 * message sequence numbers, which bound their length. */
+		if ((ctx->gen.opts & OPEN_SIZE) && ctx->gen.size_limit && maxuid >= minuid) {
+			if (CAP(ESEARCH)) {
+				sprintf( buf, "UID %d:%d LARGER %d", minuid, maxuid, ctx->gen.size_limit );
+				if (imap_submit_search( ctx, buf, minuid, maxuid, sts, imap_load_large_p2 ) < 0)
+					goto done;
+			} else {
+				for (i = 1; i <= ctx->gen.count; i += SEARCH_WINDOW) {
+					sprintf( buf, "%d:%d UID %d:%d LARGER %d", i,
+					         i + SEARCH_WINDOW - 1 < ctx->gen.count ? i + SEARCH_WINDOW - 1 : ctx->gen.count,
+					         minuid, maxuid, ctx->gen.size_limit );
+					if (imap_submit_search( ctx, buf, minuid, maxuid, sts, imap_load_large_p2 ) < 0)
+						goto done;
+				}
+			}
+		}
 		sort_ints( excs, nexcs );
-		for (i = 0; i < nexcs; ) {
-			for (bl = 0; i < nexcs && bl < 960; i++) {
-				if (bl)
-					buf[bl++] = ',';
-				bl += sprintf( buf + bl, "%d", excs[i] );
-				j = i;
-				for (; i + 1 < nexcs && excs[i + 1] == excs[i] + 1; i++) {}
-				if (i != j)
-					bl += sprintf( buf + bl, ":%d", excs[i] );
+		rngs = nfmalloc( nexcs * 2 * sizeof(int) );
+		for (nrngs = i = 0; i < nexcs; nrngs++) {
+			rngs[nrngs * 2] = j = excs[i];
+			for (; i + 1 < nexcs && excs[i + 1] == excs[i] + 1 && excs[i + 1] - j < SEARCH_WINDOW; i++) {}
+			rngs[nrngs * 2 + 1] = excs[i++];
+		}
+		i = 0;
+		imap_make_set( buf, rngs, nrngs, &i, 0 );
+		if (i < nrngs && CAP(ESEARCH)) {
+			/* The exceptions don't fit into a single command. Typically, most
+			 * of them are gone, so look up which ones still exist - ESEARCH
+			 * returns them compactly - and fetch only those in the end.
+			 * Nearby ranges are searched as one span to shorten the commands;
+			 * the results are filtered afterwards. */
+			for (i = 0, j = 1; j < nrngs; j++) {
+				if (rngs[j * 2 + 1] - rngs[i * 2] < SEARCH_WINDOW) {
+					rngs[i * 2 + 1] = rngs[j * 2 + 1];
+				} else {
+					i++;
+					rngs[i * 2] = rngs[j * 2];
+					rngs[i * 2 + 1] = rngs[j * 2 + 1];
+				}
+			}
+			nrngs = i + 1;
+			for (i = 0; i < nrngs; ) {
+				memcpy( buf, "UID ", 4 );
+				k = i;
+				imap_make_set( buf + 4, rngs, nrngs, &i, SEARCH_WINDOW );
+				vars->searching++;
+				if (imap_submit_search( ctx, buf, rngs[k * 2], rngs[i * 2 - 1], sts, imap_load_excs_p2 ) < 0) {
+					free( rngs );
+					goto done;
+				}
 			}
-			if (imap_submit_load( ctx, buf, 0, sts ) < 0)
+			free( rngs );
+		} else {
+			i = imap_submit_load_ranges( ctx, rngs, nrngs, sts );
+			free( rngs );
+			if (i < 0)
 				goto done;
 		}
-		if (maxuid == INT_MAX)
-			maxuid = ctx->gen.uidnext ? ctx->gen.uidnext - 1 : 1000000000;
 		if (maxuid >= minuid) {
 			if ((ctx->gen.opts & OPEN_FIND) && minuid < newuid) {
 				sprintf( buf, "%d:%d", minuid, newuid - 1 );
@@ -1724,7 +2001,6 @@ imap_load( store_t *gctx, int minuid, int maxuid, int newuid, int *excs, int nex
 			imap_submit_load( ctx, buf, (ctx->gen.opts & OPEN_FIND), sts );
 		}
 	  done:
-		free( excs );
 		imap_refcounted_done( sts );
 	}
 }
@@ -1733,12 +2009,206 @@ static int
 imap_submit_load( imap_store_t *ctx, const char *buf, int tuids, struct imap_cmd_refcounted_state *sts )
 {
 	return imap_exec( ctx, imap_refcounted_new_cmd( sts ), imap_refcounted_done_box,
-	                  "UID FETCH %s (UID%s%s%s)", buf,
+	                  "UID FETCH %s (UID%s%s%s%s)", buf,
 	                  (ctx->gen.opts & OPEN_FLAGS) ? " FLAGS" : "",
-	                  (ctx->gen.opts & OPEN_SIZE) ? " RFC822.SIZE" : "",
+	                  CAP(GMAIL) ? " X-GM-MSGID" : "",
+	                  ((ctx->gen.opts & OPEN_SIZE) && !ctx->gen.size_limit) ? " RFC822.SIZE" : "",
 	                  tuids ? " BODY.PEEK[HEADER.FIELDS (X-TUID)]" : "");
 }
 
+/* Format as many UID ranges as fit into one command, starting at *ip.
+ * If maxuids is not zero, stop before the ranges cover more UIDs. */
+static void
+imap_make_set( char *buf, int *rngs, int nrngs, int *ip, int maxuids )
+{
+	int i, bl, nuids;
+
+	for (bl = nuids = 0, i = *ip; i < nrngs && bl < 960; i++) {
+		nuids += rngs[i * 2 + 1] - rngs[i * 2] + 1;
+		if (maxuids && bl && nuids > maxuids)
+			break;
+		if (bl)
+			buf[bl++] = ',';
+		bl += sprintf( buf + bl, "%d", rngs[i * 2] );
+		if (rngs[i * 2 + 1] != rngs[i * 2])
+			bl += sprintf( buf + bl, ":%d", rngs[i * 2 + 1] );
+	}
+	*ip = i;
+}
+
+static int
+imap_submit_load_ranges( imap_store_t *ctx, int *rngs, int nrngs, struct imap_cmd_refcounted_state *sts )
+{
+	int i;
+	char buf[1000];
+
+	for (i = 0; i < nrngs; ) {
+		imap_make_set( buf, rngs, nrngs, &i, 0 );
+		if (imap_submit_load( ctx, buf, 0, sts ) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+imap_submit_search( imap_store_t *ctx, const char *buf, int minuid, int maxuid,
+                    struct imap_cmd_refcounted_state *sts,
+                    void (*done)( imap_store_t *ctx, struct imap_cmd *cmd, int response ) )
+{
+	struct imap_cmd_search *cmd = (struct imap_cmd_search *)new_imap_cmd( sizeof(*cmd) );
+
+	cmd->gen.state = sts;
+	sts->ref_count++;
+	cmd->gen.gen.param.search = 1;
+	cmd->uids = 0;
+	cmd->nuids = cmd->ruids = 0;
+	cmd->minuid = minuid;
+	cmd->maxuid = maxuid;
+	return imap_exec( ctx, &cmd->gen.gen, done, "UID SEARCH %s%s",
+	                  CAP(ESEARCH) ? "RETURN (ALL) " : "", buf );
+}
+
+static void
+imap_load_large_p2( imap_store_t *ctx, struct imap_cmd *cmd, int response )
+{
+	struct imap_cmd_search *cmdp = (struct imap_cmd_search *)cmd;
+	struct imap_load_vars *vars = cmdp->gen.state->callback_aux;
+
+	if (response == RESP_OK && cmdp->nuids) {
+		vars->large = nfrealloc( vars->large, (vars->nlarge + cmdp->nuids) * sizeof(int) );
+		memcpy( vars->large + vars->nlarge, cmdp->uids, cmdp->nuids * sizeof(int) );
+		vars->nlarge += cmdp->nuids;
+	}
+	free( cmdp->uids );
+	imap_refcounted_done_box( ctx, cmd, response );
+}
+
+static void
+imap_load_excs_p2( imap_store_t *ctx, struct imap_cmd *cmd, int response )
+{
+	struct imap_cmd_search *cmdp = (struct imap_cmd_search *)cmd;
+	struct imap_load_vars *vars = cmdp->gen.state->callback_aux;
+	int i, k, nrngs, *rngs;
+
+	if (response == RESP_OK && cmdp->nuids) {
+		sort_ints( cmdp->uids, cmdp->nuids );
+		vars->found = nfrealloc( vars->found, (vars->nfound + cmdp->nuids) * sizeof(int) );
+		for (i = k = 0; k < cmdp->nuids; k++) {
+			for (; i < vars->nexcs && vars->excs[i] < cmdp->uids[k]; i++) {}
+			if (i < vars->nexcs && vars->excs[i] == cmdp->uids[k])
+				vars->found[vars->nfound++] = cmdp->uids[k];
+		}
+	}
+	free( cmdp->uids );
+	/* Fetch the surviving exceptions of all lookups together,
+	 * so they need as few commands as possible. */
+	if (!--vars->searching && vars->nfound && response == RESP_OK && cmdp->gen.state->ret_val == DRV_OK) {
+		sort_ints( vars->found, vars->nfound );
+		rngs = nfmalloc( vars->nfound * 2 * sizeof(int) );
+		for (nrngs = i = 0; i < vars->nfound; nrngs++) {
+			rngs[nrngs * 2] = vars->found[i];
+			for (; i + 1 < vars->nfound && vars->found[i + 1] == vars->found[i] + 1; i++) {}
+			rngs[nrngs * 2 + 1] = vars->found[i++];
+		}
+		imap_submit_load_ranges( ctx, rngs, nrngs, cmdp->gen.state );
+		free( rngs );
+	}
+	imap_refcounted_done_box( ctx, cmd, response );
+}
+
+static int
+imap_compare_msgs( const void *a, const void *b )
+{
+	return (*(const message_t **)a)->uid - (*(const message_t **)b)->uid;
+}
+
+static void
+imap_sort_msgs( imap_store_t *ctx )
+{
+	message_t *msg, **msgs;
+	int i, n;
+
+	for (n = 0, msg = ctx->gen.msgs; msg; msg = msg->next, n++)
+		if (msg->next && msg->next->uid < msg->uid)
+			goto unsorted;
+	return;
+
+  unsorted:
+	for (; msg; msg = msg->next, n++) {}
+	msgs = nfmalloc( n * sizeof(*msgs) );
+	for (i = 0, msg = ctx->gen.msgs; msg; msg = msg->next)
+		msgs[i++] = msg;
+	qsort( msgs, n, sizeof(*msgs), imap_compare_msgs );
+	ctx->msgapp = &ctx->gen.msgs;
+	for (i = 0; i < n; i++) {
+		*ctx->msgapp = msgs[i];
+		ctx->msgapp = &msgs[i]->next;
+	}
+	*ctx->msgapp = 0;
+	free( msgs );
+}
+
+static void imap_load_p3( int, void * );
+
+static void
+imap_load_p2( int sts, void *aux )
+{
+	struct imap_load_vars *vars = (struct imap_load_vars *)aux;
+	imap_store_t *ctx = vars->ctx;
+	struct imap_cmd_refcounted_state *sts2;
+	message_t *msg, *fmsg;
+	int i, bl;
+	char buf[1000];
+
+	free( vars->excs );
+	if (sts == DRV_OK) {
+		/* Exceptions may have been fetched after the main range. */
+		imap_sort_msgs( ctx );
+		if (vars->nlarge) {
+			sort_ints( vars->large, vars->nlarge );
+			sts2 = imap_refcounted_new_state( imap_load_p3, vars );
+			ctx->sizemsg = ctx->gen.msgs;
+			for (i = 0, msg = ctx->gen.msgs; ; ) {
+				for (bl = 0; msg && bl < 960; msg = msg->next) {
+					for (; i < vars->nlarge && vars->large[i] < msg->uid; i++) {}
+					if (i == vars->nlarge || vars->large[i] != msg->uid)
+						continue;
+					if (bl)
+						buf[bl++] = ',';
+					bl += sprintf( buf + bl, "%d", msg->uid );
+					for (fmsg = msg; msg->next && msg->next->uid == msg->uid + 1 &&
+					                 ++i < vars->nlarge && vars->large[i] == msg->next->uid;
+					     msg = msg->next) {}
+					if (msg != fmsg)
+						bl += sprintf( buf + bl, ":%d", msg->uid );
+				}
+				if (!bl)
+					break;
+				if (imap_exec( ctx, imap_refcounted_new_cmd( sts2 ), imap_refcounted_done_box,
+				               "UID FETCH %s (RFC822.SIZE)", buf ) < 0)
+					break;
+			}
+			imap_refcounted_done( sts2 );
+			return;
+		}
+	}
+	imap_load_p3( sts, vars );
+}
+
+static void
+imap_load_p3( int sts, void *aux )
+{
+	struct imap_load_vars *vars = (struct imap_load_vars *)aux;
+	void (*cb)( int sts, void *aux ) = vars->callback;
+
+	vars->ctx->sizemsg = 0;
+	aux = vars->callback_aux;
+	free( vars->large );
+	free( vars->found );
+	free( vars );
+	cb( sts, aux );
+}
+
 /******************* imap_fetch_msg *******************/
 
 static void
@@ -1956,6 +2426,77 @@ imap_store_msg_p2( imap_store_t *ctx ATTR_UNUSED, struct imap_cmd *cmd, int resp
 	cmdp->callback( response, cmdp->out_uid, cmdp->callback_aux );
 }
 
+/******************* imap_link_msg *******************/
+
+static void
+imap_link_msg( store_t *gctx ATTR_UNUSED, msg_data_t *data ATTR_UNUSED, int to_trash ATTR_UNUSED,
+               void (*cb)( int sts, int uid, void *aux ), void *aux )
+{
+	cb( DRV_MSG_BAD, 0, aux );
+}
+
+/******************* imap_copy_msg *******************/
+
+static int
+imap_can_copy( store_t *gctx, store_t *dst, int tuid )
+{
+	imap_store_t *ctx = (imap_store_t *)gctx;
+
+	/* The copy's UID comes from the COPYUID response, which needs UIDPLUS.
+	 * Should it get lost, the copy could be found only by its TUID, which
+	 * a COPY cannot add. So only copies which need no TUID are possible,
+	 * i.e., remote trashing. */
+	return ((imap_store_conf_t *)ctx->gen.conf)->server == ((imap_store_conf_t *)dst->conf)->server &&
+	       CAP(UIDPLUS) && !tuid;
+}
+
+static void
+imap_copy_msg( store_t *gctx, message_t *msg, store_t *dst, const char *tuid ATTR_UNUSED, int to_trash,
+               int date ATTR_UNUSED, /* a COPY always keeps the INTERNALDATE */
+               void (*cb)( int sts, int uid, void *aux ), void *aux )
+{
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	struct imap_cmd_copy_msg *cmd;
+	char buf[1024];
+
+	INIT_IMAP_CMD_X(imap_cmd_copy_msg, cmd, cb, aux)
+	cmd->gen.out_uid = -2;
+	cmd->dst = dst;
+	if (to_trash) {
+		/* The trash belongs to the other store, but we don't have one
+		 * ourselves (otherwise we'd not remote-trash), so we can track
+		 * its existence (trashnc, TRYCREATE) in our state. */
+		assert( !ctx->gen.conf->trash );
+		cmd->gen.gen.param.create = 1;
+		cmd->gen.gen.param.to_trash = 1;
+		if (prepare_trash( buf, (imap_store_t *)dst ) < 0) {
+			cb( DRV_BOX_BAD, -1, aux );
+			return;
+		}
+	} else {
+		if (prepare_box( buf, (imap_store_t *)dst ) < 0) {
+			cb( DRV_BOX_BAD, -1, aux );
+			return;
+		}
+	}
+	imap_exec( ctx, &cmd->gen.gen, imap_copy_msg_p2,
+	           "UID COPY %d \"%s\"", msg->uid, buf );
+}
+
+static void
+imap_copy_msg_p2( imap_store_t *ctx ATTR_UNUSED, struct imap_cmd *cmd, int response )
+{
+	struct imap_cmd_copy_msg *cmdp = (struct imap_cmd_copy_msg *)cmd;
+
+	transform_msg_response( &response );
+	if (response == DRV_OK && cmdp->gen.out_uid > 0 && !cmdp->gen.gen.param.to_trash &&
+	    cmdp->uidvalidity != cmdp->dst->uidvalidity) {
+		error( "IMAP error: UIDVALIDITY of mailbox '%s' changed\n", cmdp->dst->name );
+		response = DRV_BOX_BAD;
+	}
+	cmdp->gen.callback( response, cmdp->gen.out_uid, cmdp->gen.callback_aux );
+}
+
 /******************* imap_find_new_msgs *******************/
 
 static void
@@ -2052,6 +2593,7 @@ imap_parse_store( conffile_t *cfg, store_conf_t **storep )
 	server->sconf.use_tlsv1 = 1;
 #endif
 	server->max_in_progress = INT_MAX;
+	server->sconf.timeout = 20;
 
 	while (getcline( cfg ) && cfg->cmd) {
 		if (!strcasecmp( "Host", cfg->cmd )) {
@@ -2080,6 +2622,8 @@ imap_parse_store( conffile_t *cfg, store_conf_t **storep )
 			server->pass_cmd = nfstrdup( cfg->val );
 		else if (!strcasecmp( "Port", cfg->cmd ))
 			server->sconf.port = parse_int( cfg );
+		else if (!strcasecmp( "Timeout", cfg->cmd ))
+			server->sconf.timeout = parse_int( cfg );
 		else if (!strcasecmp( "PipelineDepth", cfg->cmd )) {
 			if ((server->max_in_progress = parse_int( cfg )) < 1) {
 				error( "%s:%d: PipelineDepth must be at least 1\n", cfg->file, cfg->line );
@@ -2184,6 +2728,9 @@ struct driver imap_driver = {
 	imap_load,
 	imap_fetch_msg,
 	imap_store_msg,
+	imap_link_msg,
+	imap_can_copy,
+	imap_copy_msg,
 	imap_find_new_msgs,
 	imap_set_flags,
 	imap_trash_msg,
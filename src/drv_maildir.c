@@ -36,7 +36,30 @@
 #include <sys/file.h>
 #include <errno.h>
 #include <time.h>
-#include <utime.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#ifdef HAVE_LINUX_FS_H
+# include <sys/ioctl.h>
+# include <linux/fs.h> /* for FICLONE */
+#endif
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_EVENTFD_H) && HAVE_DECL_IORING_OP_UNLINKAT
+# include <sys/syscall.h>
+# ifdef __NR_io_uring_setup
+#  define USE_URING 1
+#  include <sys/eventfd.h>
+#  include <linux/io_uring.h>
+# endif
+#endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+# ifdef HAVE_SYS_POLL_H
+#  define USE_WORKERS 1
+#  include <signal.h>
+# endif
+#endif
+#if defined(USE_URING) || defined(USE_WORKERS)
+# define USE_ASYNC 1
+#endif
 
 #define USE_DB 1
 #ifdef __linux__
@@ -54,6 +77,8 @@
 typedef struct maildir_store_conf {
 	store_conf_t gen;
 	char *inbox;
+	int hard_links;
+	int use_uring;
 #ifdef USE_DB
 	int alt_map;
 #endif /* USE_DB */
@@ -64,22 +89,672 @@ typedef struct maildir_message {
 	char *base;
 } maildir_message_t;
 
+typedef struct {
+	char *base;
+	int size;
+	unsigned uid:31, recent:1;
+	char tuid[TUIDL];
+} msg_t;
+
+typedef struct {
+	msg_t *ents;
+	int nents, nalloc;
+	const char *shared, *shared_end; /* names in this range are not owned */
+} msglist_t;
+
+typedef struct {
+	time_t mtime, ctime;
+	long mnsec, cnsec;
+	unsigned long ino;
+} dirstamp_t;
+
+/* A stored message waiting for its batch to be synced to disk. */
+typedef struct maildir_pending {
+	struct maildir_pending *next;
+	char *tmpname, *name, *msgid;
+	int fd, tdfd, ddfd, uid, err;
+	char tuid[TUIDL];
+	void (*cb)( int sts, int uid, void *aux );
+	void *aux;
+} maildir_pending_t;
+
+/* A flag change waiting for commit(). */
+typedef struct maildir_flags_op {
+	struct maildir_flags_op *next;
+	maildir_message_t *msg;
+	int add, del;
+	void (*cb)( int sts, void *aux );
+	void *aux;
+} maildir_flags_op_t;
+
 typedef struct maildir_store {
 	store_t gen;
 	int uvfd, uvok, nuid;
+	struct flock lck;
+	int dfds[3]; /* cur/, new/ and tmp/ of the selected box */
+	int rsvuid, nrsvuids, uidbatch; /* UIDs reserved, but not used yet */
 	int minuid, maxuid, newuid, nexcs, *excs;
 	char *trash;
+	wakeup_t scan_wakeup; /* for delayed loading */
+	maildir_pending_t *pending, **pending_append;
+	int npending;
+	unsigned cb_gen; /* bumped by cleanup, which callbacks may trigger */
+	int cb_depth, disowned; /* the store is freed only when no callbacks run */
+	wakeup_t flush_wakeup;
+	maildir_flags_op_t *flag_ops, **flag_ops_append; /* queued until commit() */
+	maildir_flags_op_t *flag_retries; /* renames which failed */
+	int nflag_ops, flags_left;
+#ifdef USE_ASYNC
+	int nuops; /* asynchronous operations which were not reported yet */
+	void (*cancel_cb)( void *aux ); /* called once they are all reported */
+	void *cancel_aux;
+#endif /* USE_ASYNC */
+#ifdef USE_URING
+	int close_left, close_retry, close_sts;
+	void (*close_cb)( int sts, void *aux );
+	void *close_aux;
+#endif /* USE_URING */
+	char *index_map; /* the mapped index, which names in the cache refer to */
+	size_t index_len;
+	ino_t index_ino; /* the index file as last read or written ... */
+	off_t index_size, index_base; /* ... unless the size is zero; base is the dump's size */
+	int index_deltas;
+	msglist_t stored; /* messages stored since the index was last saved */
+	msglist_t cache; /* complete listing of cur/ and new/ ... */
+	dirstamp_t cache_stamps[2]; /* ... as of these directory stamps */
+	int cache_ok, cache_read;
+	void (*load_cb)( int sts, void *aux );
+	void *load_aux;
 #ifdef USE_DB
 	DB *db;
+	DB *msgid_db; /* server-wide message ID => file, for all boxes; used only while locked */
+	int msgid_lfd, msgid_db_failed;
+	struct flock msgid_lck;
+	int uids_dirty; /* UIDs of stored messages were not synced yet */
+	DBT key, value; /* scratch space, which saves lots of memset()s */
 #endif /* USE_DB */
 } maildir_store_t;
 
+static void maildir_free_store( maildir_store_t *ctx );
 #ifdef USE_DB
-static DBT key, value; /* no need to be reentrant, and this saves lots of memset()s */
+static void maildir_close_msgid_map( maildir_store_t *ctx );
 #endif /* USE_DB */
-static struct flock lck;
 
-static int MaildirCount;
+/* Callbacks invoked between these two may cancel the store. It stays
+ * allocated until the outermost leave, so the generation returned by the
+ * enter can be compared against it to tell whether that happened. */
+static unsigned
+maildir_guard_enter( maildir_store_t *ctx )
+{
+	ctx->cb_depth++;
+	return ctx->cb_gen;
+}
+
+#define maildir_guard_dead( ctx, gen ) ((ctx)->cb_gen != (gen))
+
+/* Returns zero if the store was cancelled - it may be gone then. */
+static int
+maildir_guard_leave( maildir_store_t *ctx, unsigned gen )
+{
+	int ok = !maildir_guard_dead( ctx, gen );
+
+	if (!--ctx->cb_depth && ctx->disowned)
+		maildir_free_store( ctx );
+	return ok;
+}
+
+/* Part of unique file names, so it is shared by all threads. */
+static int
+maildir_next_count( void )
+{
+	static int MaildirCount;
+#ifdef HAVE_PTHREAD
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int n;
+
+	pthread_mutex_lock( &lock );
+	n = ++MaildirCount;
+	pthread_mutex_unlock( &lock );
+	return n;
+#else
+	return ++MaildirCount;
+#endif
+}
+
+#ifdef USE_ASYNC
+/* Slow file operations are done asynchronously where possible: bulk
+ * renames and unlinks go through an io_uring on Linux, and reading,
+ * writing and syncing messages is left to a small pool of worker threads.
+ * Completions are reported from main_loop(), so the driver's callback
+ * contract is unaffected. Whenever neither is available, or they are
+ * saturated, the synchronous code runs instead. */
+
+typedef struct maildir_uop {
+	struct maildir_uop *next;
+	maildir_store_t *ctx; /* null when the operation is dropped */
+	void (*work)( struct maildir_uop *op ); /* run by a worker thread */
+	void (*done)( struct maildir_uop *op );
+	void *aux;
+	char *name, *name2; /* copies, as the operation may outlive the caller's buffers */
+	int res;
+} maildir_uop_t;
+
+/* Each thread which runs an event loop has its own queues. */
+static THREAD_LOCAL maildir_uop_t *Done, **DoneAppend; /* completed, but not reported yet */
+static THREAD_LOCAL wakeup_t AsyncWakeup;
+static THREAD_LOCAL int AsyncInit;
+
+static void maildir_async_timeout( void *aux );
+
+static maildir_uop_t *
+maildir_async_new( maildir_store_t *ctx, const char *name, const char *name2,
+                   void (*done)( maildir_uop_t *op ), void *aux )
+{
+	maildir_uop_t *op;
+	int nl, nl2;
+
+	if (!AsyncInit) {
+		init_wakeup( &AsyncWakeup, maildir_async_timeout, 0 );
+		DoneAppend = &Done;
+		AsyncInit = 1;
+	}
+	nl = name ? strlen( name ) + 1 : 0;
+	nl2 = name2 ? strlen( name2 ) + 1 : 0;
+	op = nfmalloc( sizeof(*op) + nl + nl2 );
+	op->next = 0;
+	op->ctx = ctx;
+	op->work = 0;
+	op->done = done;
+	op->aux = aux;
+	op->name = nl ? memcpy( op + 1, name, nl ) : 0;
+	op->name2 = nl2 ? memcpy( (char *)(op + 1) + nl, name2, nl2 ) : 0;
+	op->res = 0;
+	ctx->nuops++;
+	return op;
+}
+
+static void
+maildir_async_completed( maildir_uop_t *op )
+{
+	op->next = 0;
+	*DoneAppend = op;
+	DoneAppend = &op->next;
+	conf_wakeup( &AsyncWakeup, 0 );
+}
+
+static void
+maildir_async_report( maildir_uop_t *op )
+{
+	maildir_store_t *ctx = op->ctx;
+	void (*cb)( void *aux );
+	unsigned guard;
+
+	guard = maildir_guard_enter( ctx );
+	ctx->nuops--;
+	op->done( op );
+	free( op );
+	/* A cancellation completes with the last operation in flight. */
+	if (!maildir_guard_dead( ctx, guard ) && !ctx->nuops && (cb = ctx->cancel_cb)) {
+		ctx->cancel_cb = 0;
+		cb( ctx->cancel_aux );
+	}
+	maildir_guard_leave( ctx, guard );
+}
+
+/* Report completed operations. The callbacks may start new ones. */
+static void
+maildir_async_dispatch( void )
+{
+	maildir_uop_t *op;
+
+	while ((op = Done)) {
+		if (!(Done = op->next))
+			DoneAppend = &Done;
+		maildir_async_report( op );
+	}
+}
+
+#ifdef USE_URING
+/* Bulk renames and unlinks are queued on an io_uring. */
+
+#define URING_ENTRIES 256
+
+static THREAD_LOCAL struct {
+	int state; /* 0 = not tried yet, 1 = usable, -1 = unavailable */
+	int fd, efd;
+	unsigned sq_entries, cq_entries, queued, inflight;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	char *ring;
+	size_t ring_size;
+} Uring;
+
+static int
+maildir_uring_setup( void )
+{
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	char *ring;
+	size_t sqsz, cqsz;
+	int ok;
+
+	if (Uring.state)
+		return Uring.state > 0;
+	Uring.state = -1;
+	memset( &p, 0, sizeof(p) );
+	if ((Uring.fd = syscall( __NR_io_uring_setup, URING_ENTRIES, &p )) < 0) {
+		debug( "Maildir notice: io_uring not available: %s\n", strerror( errno ) );
+		return 0;
+	}
+	probe = nfcalloc( sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op) );
+	ok = (p.features & IORING_FEAT_SINGLE_MMAP) &&
+	     !syscall( __NR_io_uring_register, Uring.fd, IORING_REGISTER_PROBE, probe, 256 ) &&
+	     probe->last_op >= IORING_OP_UNLINKAT &&
+	     (probe->ops[IORING_OP_RENAMEAT].flags & IO_URING_OP_SUPPORTED) &&
+	     (probe->ops[IORING_OP_UNLINKAT].flags & IO_URING_OP_SUPPORTED);
+	free( probe );
+	if (!ok) {
+		debug( "Maildir notice: io_uring lacks needed operations\n" );
+		goto bail;
+	}
+	sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cqsz > sqsz)
+		sqsz = cqsz;
+	if ((ring = mmap( 0, sqsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, Uring.fd, IORING_OFF_SQ_RING )) == MAP_FAILED)
+		goto sbail;
+	Uring.sqes = mmap( 0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+	                   MAP_SHARED|MAP_POPULATE, Uring.fd, IORING_OFF_SQES );
+	if (Uring.sqes == MAP_FAILED) {
+		munmap( ring, sqsz );
+		goto sbail;
+	}
+	if ((Uring.efd = eventfd( 0, EFD_CLOEXEC|EFD_NONBLOCK )) < 0)
+		goto mbail;
+	if (syscall( __NR_io_uring_register, Uring.fd, IORING_REGISTER_EVENTFD, &Uring.efd, 1 )) {
+		close( Uring.efd );
+	  mbail:
+		munmap( Uring.sqes, p.sq_entries * sizeof(struct io_uring_sqe) );
+		munmap( ring, sqsz );
+	  sbail:
+		sys_error( "Maildir warning: cannot set up io_uring" );
+		goto bail;
+	}
+	Uring.ring = ring;
+	Uring.ring_size = sqsz;
+	Uring.sq_head = (unsigned *)(ring + p.sq_off.head);
+	Uring.sq_tail = (unsigned *)(ring + p.sq_off.tail);
+	Uring.sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+	Uring.sq_array = (unsigned *)(ring + p.sq_off.array);
+	Uring.cq_head = (unsigned *)(ring + p.cq_off.head);
+	Uring.cq_tail = (unsigned *)(ring + p.cq_off.tail);
+	Uring.cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+	Uring.cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+	Uring.sq_entries = p.sq_entries;
+	Uring.cq_entries = p.cq_entries;
+	Uring.state = 1;
+	return 1;
+
+  bail:
+	close( Uring.fd );
+	return 0;
+}
+
+static void
+maildir_uring_submit( unsigned wait )
+{
+	int n;
+
+	for (;;) {
+		if ((n = syscall( __NR_io_uring_enter, Uring.fd, Uring.queued, wait,
+		                  wait ? IORING_ENTER_GETEVENTS : 0, 0, 0 )) >= 0) {
+			Uring.queued -= n;
+			return;
+		}
+		if (errno != EINTR) {
+			/* The entries stay queued and are submitted with the next call. */
+			sys_error( "Maildir error: cannot submit to io_uring" );
+			return;
+		}
+	}
+}
+
+/* Move completions from the ring to the list of reportable operations. */
+static void
+maildir_uring_collect( void )
+{
+	struct io_uring_cqe *cqe;
+	maildir_uop_t *op;
+	unsigned head;
+	char buf[8];
+
+	if (read( Uring.efd, buf, sizeof(buf) ) < 0 && errno != EAGAIN)
+		sys_error( "Maildir error: cannot read io_uring event" );
+	for (head = *Uring.cq_head; ; head++) {
+		__sync_synchronize();
+		if (head == *(volatile unsigned *)Uring.cq_tail)
+			break;
+		cqe = &Uring.cqes[head & *Uring.cq_mask];
+		op = (maildir_uop_t *)(size_t)cqe->user_data;
+		op->res = cqe->res;
+		maildir_async_completed( op );
+		if (!--Uring.inflight)
+			del_fd( Uring.efd );
+	}
+	__sync_synchronize();
+	*(volatile unsigned *)Uring.cq_head = head;
+}
+
+static void
+maildir_uring_fd_cb( int events ATTR_UNUSED, void *aux ATTR_UNUSED )
+{
+	maildir_uring_collect();
+	maildir_async_dispatch();
+}
+
+/* Returns a submission entry for a new operation, or null if the caller
+ * should do the work synchronously. */
+static struct io_uring_sqe *
+maildir_uring_get( maildir_store_t *ctx, const char *name, const char *name2,
+                   void (*done)( maildir_uop_t *op ), void *aux )
+{
+	struct io_uring_sqe *sqe;
+	maildir_uop_t *op;
+	unsigned tail, idx;
+
+	/* Never have more in flight than the completion queue can hold. */
+	if (!((maildir_store_conf_t *)ctx->gen.conf)->use_uring ||
+	    !maildir_uring_setup() || Uring.inflight >= Uring.cq_entries)
+		return 0;
+	if (Uring.queued == Uring.sq_entries)
+		maildir_uring_submit( 0 );
+	if (Uring.queued == Uring.sq_entries)
+		return 0;
+	op = maildir_async_new( ctx, name, name2, done, aux );
+
+	tail = *Uring.sq_tail;
+	idx = tail & *Uring.sq_mask;
+	sqe = &Uring.sqes[idx];
+	memset( sqe, 0, sizeof(*sqe) );
+	sqe->user_data = (size_t)op;
+	Uring.sq_array[idx] = idx;
+	__sync_synchronize();
+	*(volatile unsigned *)Uring.sq_tail = tail + 1;
+	Uring.queued++;
+	if (!Uring.inflight++) {
+		add_fd( Uring.efd, maildir_uring_fd_cb, 0 );
+		conf_fd( Uring.efd, 0, POLLIN );
+	}
+	/* Everything queued during this round of events is submitted at once. */
+	conf_wakeup( &AsyncWakeup, 0 );
+	return sqe;
+}
+
+static int
+maildir_uring_rename( maildir_store_t *ctx, int odfd, const char *oname, int ndfd, const char *nname,
+                      void (*done)( maildir_uop_t *op ), void *aux )
+{
+	struct io_uring_sqe *sqe;
+	maildir_uop_t *op;
+
+	if (!(sqe = maildir_uring_get( ctx, oname, nname, done, aux )))
+		return 0;
+	op = (maildir_uop_t *)(size_t)sqe->user_data;
+	sqe->opcode = IORING_OP_RENAMEAT;
+	sqe->fd = odfd;
+	sqe->addr = (size_t)op->name;
+	sqe->len = ndfd;
+	sqe->addr2 = (size_t)op->name2;
+	return 1;
+}
+
+static int
+maildir_uring_unlink( maildir_store_t *ctx, int dfd, const char *name,
+                      void (*done)( maildir_uop_t *op ), void *aux )
+{
+	struct io_uring_sqe *sqe;
+	maildir_uop_t *op;
+
+	if (!(sqe = maildir_uring_get( ctx, name, 0, done, aux )))
+		return 0;
+	op = (maildir_uop_t *)(size_t)sqe->user_data;
+	sqe->opcode = IORING_OP_UNLINKAT;
+	sqe->fd = dfd;
+	sqe->addr = (size_t)op->name;
+	return 1;
+}
+#endif /* USE_URING */
+
+#ifdef USE_WORKERS
+/* Reading, writing and syncing messages is done by worker threads, so a
+ * slow disk does not hold up the network, and vice versa. The workers
+ * only make system calls; everything else happens in the thread which
+ * runs the event loop, and each such thread has its own pool. */
+
+#define NUM_WORKERS 4
+
+typedef struct {
+	int state; /* 1 = running, -1 = unavailable */
+	int fds[2]; /* wakes the main loop when something is finished */
+	int busy; /* operations queued, running, or finished, but not collected */
+	int quit, nthreads; /* the last thread to quit frees the pool */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	maildir_uop_t *queue, **queue_append;
+	maildir_uop_t *finished, **finished_append;
+} maildir_workers_t;
+
+static THREAD_LOCAL maildir_workers_t *Workers; /* the pool of this thread's event loop */
+
+static void *
+maildir_worker( void *arg )
+{
+	maildir_workers_t *w = (maildir_workers_t *)arg;
+	maildir_uop_t *op;
+	int last;
+	char c = 0;
+
+	pthread_mutex_lock( &w->lock );
+	for (;;) {
+		while (!(op = w->queue) && !w->quit)
+			pthread_cond_wait( &w->cond, &w->lock );
+		if (!op)
+			break;
+		if (!(w->queue = op->next))
+			w->queue_append = &w->queue;
+		pthread_mutex_unlock( &w->lock );
+		op->work( op );
+		pthread_mutex_lock( &w->lock );
+		if (!w->finished)
+			while (write( w->fds[1], &c, 1 ) < 0 && errno == EINTR);
+		op->next = 0;
+		*w->finished_append = op;
+		w->finished_append = &op->next;
+	}
+	last = !--w->nthreads;
+	pthread_mutex_unlock( &w->lock );
+	if (last) {
+		close( w->fds[0] );
+		close( w->fds[1] );
+		pthread_mutex_destroy( &w->lock );
+		pthread_cond_destroy( &w->cond );
+		free( w );
+	}
+	return 0;
+}
+
+static int
+maildir_workers_setup( void )
+{
+	maildir_workers_t *w;
+	pthread_t thr;
+	sigset_t all, old;
+	int i, n;
+
+	if (Workers)
+		return Workers->state > 0;
+	Workers = w = nfcalloc( sizeof(*w) );
+	w->state = -1;
+	if (pipe( w->fds )) {
+		sys_error( "Maildir warning: cannot create pipe for worker threads" );
+		return 0;
+	}
+	fcntl( w->fds[0], F_SETFL, O_NONBLOCK );
+	fcntl( w->fds[0], F_SETFD, FD_CLOEXEC );
+	fcntl( w->fds[1], F_SETFD, FD_CLOEXEC );
+	pthread_mutex_init( &w->lock, 0 );
+	pthread_cond_init( &w->cond, 0 );
+	w->queue_append = &w->queue;
+	w->finished_append = &w->finished;
+	/* Signals are for the main loop. */
+	sigfillset( &all );
+	pthread_sigmask( SIG_SETMASK, &all, &old );
+	for (n = i = 0; i < NUM_WORKERS; i++)
+		if (!pthread_create( &thr, 0, maildir_worker, w )) {
+			pthread_detach( thr );
+			n++;
+		}
+	pthread_sigmask( SIG_SETMASK, &old, 0 );
+	if (!n) {
+		error( "Maildir warning: cannot start worker threads\n" );
+		close( w->fds[0] );
+		close( w->fds[1] );
+		return 0;
+	}
+	w->nthreads = n;
+	w->state = 1;
+	return 1;
+}
+
+static void
+maildir_workers_collect( void )
+{
+	maildir_uop_t *op, *next;
+	char buf[64];
+
+	while (read( Workers->fds[0], buf, sizeof(buf) ) > 0);
+	pthread_mutex_lock( &Workers->lock );
+	op = Workers->finished;
+	Workers->finished = 0;
+	Workers->finished_append = &Workers->finished;
+	pthread_mutex_unlock( &Workers->lock );
+	for (; op; op = next) {
+		next = op->next;
+		maildir_async_completed( op );
+		if (!--Workers->busy)
+			del_fd( Workers->fds[0] );
+	}
+}
+
+static void
+maildir_workers_fd_cb( int events ATTR_UNUSED, void *aux ATTR_UNUSED )
+{
+	maildir_workers_collect();
+	maildir_async_dispatch();
+}
+
+/* Returns zero if the caller should do the work synchronously. */
+static int
+maildir_work( maildir_store_t *ctx, const char *name, const char *name2, void (*work)( maildir_uop_t *op ),
+              void (*done)( maildir_uop_t *op ), void *aux )
+{
+	maildir_uop_t *op;
+
+	if (!maildir_workers_setup())
+		return 0;
+	op = maildir_async_new( ctx, name, name2, done, aux );
+	op->work = work;
+	if (!Workers->busy++) {
+		add_fd( Workers->fds[0], maildir_workers_fd_cb, 0 );
+		conf_fd( Workers->fds[0], 0, POLLIN );
+	}
+	pthread_mutex_lock( &Workers->lock );
+	*Workers->queue_append = op;
+	Workers->queue_append = &op->next;
+	pthread_cond_signal( &Workers->cond );
+	pthread_mutex_unlock( &Workers->lock );
+	return 1;
+}
+#endif /* USE_WORKERS */
+
+static void
+maildir_async_timeout( void *aux ATTR_UNUSED )
+{
+#ifdef USE_URING
+	if (Uring.state > 0) {
+		if (Uring.queued)
+			maildir_uring_submit( 0 );
+		maildir_uring_collect();
+	}
+#endif /* USE_URING */
+	maildir_async_dispatch();
+}
+
+/* Block until some operation completes. This is for maildir_async_drain()
+ * only; everything else is completed from main_loop(). */
+static void
+maildir_async_wait( void )
+{
+	struct pollfd pfds[2];
+	int n = 0;
+
+#ifdef USE_URING
+	if (Uring.state > 0 && Uring.inflight) {
+		if (Uring.queued)
+			maildir_uring_submit( 0 );
+		pfds[n].fd = Uring.efd;
+		pfds[n++].events = POLLIN;
+	}
+#endif /* USE_URING */
+#ifdef USE_WORKERS
+	if (Workers && Workers->busy) {
+		pfds[n].fd = Workers->fds[0];
+		pfds[n++].events = POLLIN;
+	}
+#endif /* USE_WORKERS */
+	if (n && poll( pfds, n, -1 ) < 0 && errno != EINTR)
+		sys_error( "Maildir error: cannot wait for file operations" );
+#ifdef USE_URING
+	if (Uring.state > 0)
+		maildir_uring_collect();
+#endif /* USE_URING */
+#ifdef USE_WORKERS
+	if (Workers && Workers->state > 0)
+		maildir_workers_collect();
+#endif /* USE_WORKERS */
+}
+
+/* Wait until all operations of the store are complete, and drop them
+ * unreported. This blocks, but it is used only when the store is cleaned
+ * up: the operations refer to its directories and messages, which are
+ * about to be freed, so they cannot be left to main_loop(). Other stores'
+ * operations are reported later. */
+static void
+maildir_async_drain( maildir_store_t *ctx )
+{
+	maildir_uop_t *op, **opp;
+
+	for (;;) {
+		for (opp = &Done; (op = *opp); ) {
+			if (op->ctx != ctx) {
+				opp = &op->next;
+				continue;
+			}
+			if (!(*opp = op->next))
+				DoneAppend = opp;
+			ctx->nuops--;
+			op->ctx = 0;
+			op->done( op );
+			free( op );
+		}
+		if (!ctx->nuops)
+			break;
+		maildir_async_wait();
+	}
+}
+#endif /* USE_ASYNC */
 
 static const char Flags[] = { 'D', 'F', 'R', 'S', 'T' };
 
@@ -121,6 +796,29 @@ maildir_join_path( const char *prefix, const char *box )
 	return out;
 }
 
+static int
+maildir_ent_shared( msglist_t *msglist, const char *base )
+{
+	return msglist->shared && base >= msglist->shared && base < msglist->shared_end;
+}
+
+static void
+maildir_free_scan( msglist_t *msglist )
+{
+	int i;
+
+	if (msglist->ents) {
+		for (i = 0; i < msglist->nents; i++)
+			if (!maildir_ent_shared( msglist, msglist->ents[i].base ))
+				free( msglist->ents[i].base );
+		free( msglist->ents );
+	}
+}
+
+static void maildir_load_p2( void *aux );
+static void maildir_flush_stored( void *aux );
+static void maildir_save_stored( maildir_store_t *ctx );
+
 static void
 maildir_open_store( store_conf_t *conf,
                     void (*cb)( store_t *ctx, void *aux ), void *aux )
@@ -136,6 +834,14 @@ maildir_open_store( store_conf_t *conf,
 	ctx = nfcalloc( sizeof(*ctx) );
 	ctx->gen.conf = conf;
 	ctx->uvfd = -1;
+	ctx->dfds[0] = ctx->dfds[1] = ctx->dfds[2] = -1;
+#ifdef USE_DB
+	ctx->msgid_lfd = -1;
+#endif /* USE_DB */
+	init_wakeup( &ctx->scan_wakeup, maildir_load_p2, ctx );
+	init_wakeup( &ctx->flush_wakeup, maildir_flush_stored, ctx );
+	ctx->pending_append = &ctx->pending;
+	ctx->flag_ops_append = &ctx->flag_ops;
 	if (conf->trash)
 		ctx->trash = maildir_join_path( conf->path, conf->trash );
 	cb( &ctx->gen, aux );
@@ -153,29 +859,106 @@ free_maildir_messages( message_t *msg )
 	}
 }
 
+static void maildir_release_uids( maildir_store_t *ctx );
+
+static void
+maildir_free_pending( maildir_pending_t *pend )
+{
+	free( pend->tmpname );
+	free( pend->name );
+	free( pend->msgid );
+	free( pend );
+}
+
+static void
+maildir_free_flag_ops( maildir_flags_op_t *fop )
+{
+	maildir_flags_op_t *next;
+
+	for (; fop; fop = next) {
+		next = fop->next;
+		free( fop );
+	}
+}
+
 static void
 maildir_cleanup( store_t *gctx )
 {
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_pending_t *pend;
+	int i;
 
+	wipe_wakeup( &ctx->scan_wakeup );
+	/* Messages which were not acknowledged yet are just dropped. */
+	wipe_wakeup( &ctx->flush_wakeup );
+	ctx->cb_gen++;
+#ifdef USE_ASYNC
+	/* The operations refer to the directories and messages freed below. */
+	maildir_async_drain( ctx );
+	ctx->cancel_cb = 0;
+#endif /* USE_ASYNC */
+	while ((pend = ctx->pending)) {
+		ctx->pending = pend->next;
+		close( pend->fd );
+		unlinkat( pend->tdfd, pend->tmpname, 0 );
+		maildir_free_pending( pend );
+	}
+	ctx->pending_append = &ctx->pending;
+	ctx->npending = 0;
+	maildir_free_flag_ops( ctx->flag_ops );
+	ctx->flag_ops = 0;
+	ctx->flag_ops_append = &ctx->flag_ops;
+	ctx->nflag_ops = 0;
+	maildir_free_flag_ops( ctx->flag_retries );
+	ctx->flag_retries = 0;
+	ctx->flags_left = 0;
+	maildir_save_stored( ctx );
+	maildir_free_scan( &ctx->cache );
+	memset( &ctx->cache, 0, sizeof(ctx->cache) );
+	ctx->cache_ok = ctx->cache_read = 0;
+	ctx->index_size = 0;
+	if (ctx->index_map) {
+		munmap( ctx->index_map, ctx->index_len );
+		ctx->index_map = 0;
+	}
 	free_maildir_messages( gctx->msgs );
 #ifdef USE_DB
 	if (ctx->db)
 		ctx->db->close( ctx->db, 0 );
+	maildir_close_msgid_map( ctx );
 #endif /* USE_DB */
+	for (i = 0; i < 3; i++)
+		if (ctx->dfds[i] >= 0)
+			close( ctx->dfds[i] );
 	free( gctx->path );
 	free( ctx->excs );
-	if (ctx->uvfd >= 0)
+	if (ctx->uvfd >= 0) {
+#ifdef USE_DB
+		if (!ctx->db)
+#endif /* USE_DB */
+			maildir_release_uids( ctx );
 		close( ctx->uvfd );
+	}
+}
+
+static void
+maildir_free_store( maildir_store_t *ctx )
+{
+	free( ctx->trash );
+	free_string_list( ctx->gen.boxes );
+	free( ctx );
 }
 
 static void
 maildir_disown_store( store_t *gctx )
 {
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+
 	maildir_cleanup( gctx );
-	free( ((maildir_store_t *)gctx)->trash );
-	free_string_list( gctx->boxes );
-	free( gctx );
+	if (ctx->cb_depth)
+		ctx->disowned = 1;
+	else
+		maildir_free_store( ctx );
 }
 
 static store_t *
@@ -187,6 +970,36 @@ maildir_own_store( store_conf_t *conf ATTR_UNUSED )
 static void
 maildir_cleanup_drv( void )
 {
+#ifdef USE_ASYNC
+	if (AsyncInit) {
+		wipe_wakeup( &AsyncWakeup );
+		AsyncInit = 0;
+	}
+#endif /* USE_ASYNC */
+#ifdef USE_WORKERS
+	if (Workers) {
+		if (Workers->state > 0) {
+			/* Nothing is in flight anymore, so the workers are idle.
+			 * The last one to leave frees the pool. */
+			pthread_mutex_lock( &Workers->lock );
+			Workers->quit = 1;
+			pthread_cond_broadcast( &Workers->cond );
+			pthread_mutex_unlock( &Workers->lock );
+		} else {
+			free( Workers );
+		}
+		Workers = 0;
+	}
+#endif /* USE_WORKERS */
+#ifdef USE_URING
+	if (Uring.state > 0) {
+		munmap( Uring.sqes, Uring.sq_entries * sizeof(struct io_uring_sqe) );
+		munmap( Uring.ring, Uring.ring_size );
+		close( Uring.efd );
+		close( Uring.fd );
+		Uring.state = 0;
+	}
+#endif /* USE_URING */
 }
 
 static void
@@ -287,28 +1100,22 @@ maildir_list( store_t *gctx, int flags,
 
 static const char *subdirs[] = { "cur", "new", "tmp" };
 
-typedef struct {
-	char *base;
-	int size;
-	unsigned uid:31, recent:1;
-	char tuid[TUIDL];
-} msg_t;
-
-typedef struct {
-	msg_t *ents;
-	int nents, nalloc;
-} msglist_t;
-
-static void
-maildir_free_scan( msglist_t *msglist )
+/* Files are mostly accessed relative to the box' subdirectories; this
+ * makes a full path out of such a name for messages. */
+static const char *
+maildir_path( maildir_store_t *ctx, int dfd, const char *name )
 {
+	static THREAD_LOCAL char bufs[2][_POSIX_PATH_MAX];
+	static THREAD_LOCAL int cur;
 	int i;
 
-	if (msglist->ents) {
-		for (i = 0; i < msglist->nents; i++)
-			free( msglist->ents[i].base );
-		free( msglist->ents );
-	}
+	for (i = 0; i < 3; i++)
+		if (dfd == ctx->dfds[i]) {
+			cur ^= 1;
+			nfsnprintf( bufs[cur], sizeof(bufs[cur]), "%s/%s/%s", ctx->gen.path, subdirs[i], name );
+			return bufs[cur];
+		}
+	return name;
 }
 
 #define _24_HOURS (3600 * 24)
@@ -389,6 +1196,35 @@ maildir_validate( const char *box, int create, maildir_store_t *ctx )
 	return DRV_OK;
 }
 
+/* Find a message file by the part of its name before the flags, as the
+ * flags may have been changed by somebody else. Returns the subdirectory
+ * the file is in, or -1. */
+static int
+maildir_find_base( const char *box, const char *base, int bl, char *name, int namesz )
+{
+	DIR *dirp;
+	struct dirent *e;
+	int i;
+	char buf[_POSIX_PATH_MAX];
+
+	for (i = 0; i < 2; i++) {
+		nfsnprintf( buf, sizeof(buf), "%s/%s", box, subdirs[i] );
+		if (!(dirp = opendir( buf )))
+			continue;
+		while ((e = readdir( dirp ))) {
+			if (!strncmp( e->d_name, base, bl ) && (!e->d_name[bl] || e->d_name[bl] == ':')) {
+				if ((int)strlen( e->d_name ) >= namesz)
+					break;
+				strcpy( name, e->d_name );
+				closedir( dirp );
+				return i;
+			}
+		}
+		closedir( dirp );
+	}
+	return -1;
+}
+
 #ifdef USE_DB
 static void
 make_key( DBT *tkey, char *name )
@@ -399,36 +1235,282 @@ make_key( DBT *tkey, char *name )
 }
 
 static int
-maildir_set_uid( maildir_store_t *ctx, const char *name, int *uid )
+maildir_compare_dbts( const void *l, const void *r )
+{
+	const DBT *lk = (const DBT *)l, *rk = (const DBT *)r;
+	int ret;
+
+	if ((ret = memcmp( lk->data, rk->data, lk->size < rk->size ? lk->size : rk->size )))
+		return ret;
+	return (int)lk->size - (int)rk->size;
+}
+
+/* Remove the entries of files which are gone from the database. The
+ * listing's keys are sorted, so each entry is checked by binary search,
+ * and the stale ones are deleted in the same pass over the database. */
+static void
+maildir_purge_uids( maildir_store_t *ctx, msglist_t *msglist )
+{
+	DBC *dbc;
+	DBT *keys;
+	int i, ret;
+
+	keys = nfmalloc( (msglist->nents + 1) * sizeof(DBT) );
+	for (i = 0; i < msglist->nents; i++)
+		make_key( &keys[i], msglist->ents[i].base );
+	qsort( keys, msglist->nents, sizeof(DBT), maildir_compare_dbts );
+	if ((ret = ctx->db->cursor( ctx->db, 0, &dbc, 0 )))
+		ctx->db->err( ctx->db, ret, "Maildir error: db->cursor()" );
+	else {
+		for (;;) {
+			if ((ret = dbc->c_get( dbc, &ctx->key, &ctx->value, DB_NEXT ))) {
+				if (ret != DB_NOTFOUND)
+					ctx->db->err( ctx->db, ret, "Maildir error: db->c_get()" );
+				break;
+			}
+			if ((ctx->key.size != 11 || memcmp( ctx->key.data, "UIDVALIDITY", 11 )) &&
+			    !bsearch( &ctx->key, keys, msglist->nents, sizeof(DBT), maildir_compare_dbts ) &&
+			    (ret = dbc->c_del( dbc, 0 ))) {
+				ctx->db->err( ctx->db, ret, "Maildir error: db->c_del()" );
+				break;
+			}
+		}
+		dbc->c_close( dbc );
+	}
+	free( keys );
+}
+
+static int
+maildir_sync_uids( maildir_store_t *ctx )
+{
+	int ret;
+
+	ctx->uids_dirty = 0;
+	if ((ret = ctx->db->sync( ctx->db, 0 ))) {
+		ctx->db->err( ctx->db, ret, "Maildir error: db->sync()" );
+		return DRV_BOX_BAD;
+	}
+	return DRV_OK;
+}
+
+/* The TUID of a message we store is recorded along with its UID, so
+ * finding it later does not require reading the message. */
+static int
+maildir_put_uid( maildir_store_t *ctx, const char *name, int *uid, const char *tuid )
 {
 	int ret, uv[2];
+	char vbuf[sizeof(int) + TUIDL];
 
 	if (uid)
 		*uid = ++ctx->nuid;
-	key.data = (void *)"UIDVALIDITY";
-	key.size = 11;
+	ctx->key.data = (void *)"UIDVALIDITY";
+	ctx->key.size = 11;
 	uv[0] = ctx->gen.uidvalidity;
 	uv[1] = ctx->nuid;
-	value.data = uv;
-	value.size = sizeof(uv);
-	if ((ret = ctx->db->put( ctx->db, 0, &key, &value, 0 ))) {
+	ctx->value.data = uv;
+	ctx->value.size = sizeof(uv);
+	if ((ret = ctx->db->put( ctx->db, 0, &ctx->key, &ctx->value, 0 ))) {
 	  tbork:
 		ctx->db->err( ctx->db, ret, "Maildir error: db->put()" );
 		return DRV_BOX_BAD;
 	}
 	if (uid) {
-		make_key( &key, (char *)name );
-		value.data = uid;
-		value.size = sizeof(*uid);
-		if ((ret = ctx->db->put( ctx->db, 0, &key, &value, 0 )))
+		make_key( &ctx->key, (char *)name );
+		memcpy( vbuf, uid, sizeof(int) );
+		ctx->value.data = vbuf;
+		ctx->value.size = sizeof(int);
+		if (tuid) {
+			memcpy( vbuf + sizeof(int), tuid, TUIDL );
+			ctx->value.size += TUIDL;
+		}
+		if ((ret = ctx->db->put( ctx->db, 0, &ctx->key, &ctx->value, 0 )))
 			goto tbork;
 	}
-	if ((ret = ctx->db->sync( ctx->db, 0 ))) {
-		ctx->db->err( ctx->db, ret, "Maildir error: db->sync()" );
-		return DRV_BOX_BAD;
-	}
 	return DRV_OK;
 }
+
+static int
+maildir_set_uid( maildir_store_t *ctx, const char *name, int *uid, const char *tuid )
+{
+	int ret;
+
+	if ((ret = maildir_put_uid( ctx, name, uid, tuid )) != DRV_OK)
+		return ret;
+	return maildir_sync_uids( ctx );
+}
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t MsgidLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* The map is shared by all boxes of the store, which other processes (or
+ * threads) may be syncing at the same time. So it is accessed only under a
+ * lock. Re-opening the database for every message would be expensive, so it
+ * stays open as long as the box does, and is flushed when the lock is
+ * released. */
+static int
+maildir_lock_msgid_map( maildir_store_t *ctx )
+{
+	int ret;
+	char buf[_POSIX_PATH_MAX];
+
+	if (ctx->msgid_db_failed)
+		return -1;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock( &MsgidLock );
+#endif
+	if (ctx->msgid_lfd < 0) {
+		nfsnprintf( buf, sizeof(buf), "%s.isyncmsgidmap.lock", ctx->gen.conf->path );
+		if ((ctx->msgid_lfd = open( buf, O_RDWR|O_CREAT, 0600 )) < 0) {
+			sys_error( "Maildir error: cannot open %s", buf );
+			goto bork;
+		}
+	}
+	memset( &ctx->msgid_lck, 0, sizeof(ctx->msgid_lck) );
+#if SEEK_SET != 0
+	ctx->msgid_lck.l_whence = SEEK_SET;
+#endif
+	ctx->msgid_lck.l_type = F_WRLCK;
+	if (fcntl( ctx->msgid_lfd, F_SETLKW, &ctx->msgid_lck )) {
+		sys_error( "Maildir error: cannot lock %s.isyncmsgidmap.lock", ctx->gen.conf->path );
+		goto bork;
+	}
+	if (!ctx->msgid_db) {
+		nfsnprintf( buf, sizeof(buf), "%s.isyncmsgidmap.db", ctx->gen.conf->path );
+		if (db_create( &ctx->msgid_db, 0, 0 )) {
+			fputs( "Maildir error: db_create() failed\n", stderr );
+			ctx->msgid_db = 0;
+			goto ubork;
+		}
+		if ((ret = (ctx->msgid_db->open)( ctx->msgid_db, 0, buf, 0, DB_HASH, DB_CREATE, 0 ))) {
+			ctx->msgid_db->err( ctx->msgid_db, ret, "Maildir error: db->open(%s)", buf );
+			ctx->msgid_db->close( ctx->msgid_db, 0 );
+			ctx->msgid_db = 0;
+			goto ubork;
+		}
+	}
+	return 0;
+
+  ubork:
+	ctx->msgid_lck.l_type = F_UNLCK;
+	fcntl( ctx->msgid_lfd, F_SETLK, &ctx->msgid_lck );
+  bork:
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock( &MsgidLock );
+#endif
+	ctx->msgid_db_failed = 1;
+	return -1;
+}
+
+static void
+maildir_unlock_msgid_map( maildir_store_t *ctx, int dirty )
+{
+	int ret;
+
+	if (dirty && (ret = ctx->msgid_db->sync( ctx->msgid_db, 0 )))
+		ctx->msgid_db->err( ctx->msgid_db, ret, "Maildir error: db->sync()" );
+	ctx->msgid_lck.l_type = F_UNLCK;
+	fcntl( ctx->msgid_lfd, F_SETLK, &ctx->msgid_lck );
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock( &MsgidLock );
+#endif
+}
+
+static void
+maildir_close_msgid_map( maildir_store_t *ctx )
+{
+	if (ctx->msgid_lfd < 0)
+		return;
+	/* Closing any descriptor of the lock file drops all of this process'
+	 * locks on it, including other threads' ones. */
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock( &MsgidLock );
+#endif
+	if (ctx->msgid_db) {
+		ctx->msgid_db->close( ctx->msgid_db, 0 );
+		ctx->msgid_db = 0;
+	}
+	close( ctx->msgid_lfd );
+	ctx->msgid_lfd = -1;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock( &MsgidLock );
+#endif
+}
+
+static void
+maildir_put_msgid( maildir_store_t *ctx, const char *msgid, const char *path )
+{
+	int ret;
+
+	ctx->key.data = (void *)msgid;
+	ctx->key.size = strlen( msgid );
+	ctx->value.data = (void *)path;
+	ctx->value.size = strlen( path );
+	if ((ret = ctx->msgid_db->put( ctx->msgid_db, 0, &ctx->key, &ctx->value, 0 )))
+		ctx->msgid_db->err( ctx->msgid_db, ret, "Maildir error: db->put()" );
+}
+
+/* Entries are not synced to disk; losing some just means re-fetching. */
+static void
+maildir_set_msgid( maildir_store_t *ctx, const char *msgid, const char *path )
+{
+	if (maildir_lock_msgid_map( ctx ) < 0)
+		return;
+	maildir_put_msgid( ctx, msgid, path );
+	maildir_unlock_msgid_map( ctx, 1 );
+}
+
+static int
+maildir_get_msgid( maildir_store_t *ctx, const char *msgid, char *buf, int bufsz )
+{
+	char *base;
+	int ret, i, nl;
+	struct stat st;
+	char nbuf[_POSIX_PATH_MAX];
+
+	if (maildir_lock_msgid_map( ctx ) < 0)
+		return -1;
+	ctx->key.data = (void *)msgid;
+	ctx->key.size = strlen( msgid );
+	if ((ret = ctx->msgid_db->get( ctx->msgid_db, 0, &ctx->key, &ctx->value, 0 ))) {
+		if (ret != DB_NOTFOUND)
+			ctx->msgid_db->err( ctx->msgid_db, ret, "Maildir error: db->get()" );
+		goto bail;
+	}
+	if ((int)ctx->value.size >= bufsz)
+		goto bail;
+	memcpy( buf, ctx->value.data, ctx->value.size );
+	buf[ctx->value.size] = 0;
+	if (!stat( buf, &st ))
+		goto ok;
+	/* The file was renamed since, due to flag changes. Look for its base name
+	 * in the box it was stored to. */
+	if (!(base = strrchr( buf, '/' )) || base - buf < 4)
+		goto gone;
+	*base++ = 0;
+	buf[strlen( buf ) - 4] = 0;
+	nl = nfsnprintf( nbuf, sizeof(nbuf), "%s/cur/", buf );
+	if ((i = maildir_find_base( buf, base, strcspn( base, ":" ), nbuf + nl, sizeof(nbuf) - nl )) >= 0 &&
+	    (int)strlen( nbuf ) < bufsz) {
+		memcpy( nbuf + nl - 4, subdirs[i], 3 );
+		strcpy( buf, nbuf );
+		maildir_put_msgid( ctx, msgid, buf );
+		maildir_unlock_msgid_map( ctx, 1 );
+		return 0;
+	  ok:
+		maildir_unlock_msgid_map( ctx, 0 );
+		return 0;
+	}
+  gone:
+	ctx->key.data = (void *)msgid;
+	ctx->key.size = strlen( msgid );
+	ctx->msgid_db->del( ctx->msgid_db, 0, &ctx->key, 0 );
+	maildir_unlock_msgid_map( ctx, 1 );
+	return -1;
+  bail:
+	maildir_unlock_msgid_map( ctx, 0 );
+	return -1;
+}
 #endif /* USE_DB */
 
 static int
@@ -456,7 +1538,7 @@ maildir_init_uid( maildir_store_t *ctx )
 	if (ctx->db) {
 		u_int32_t count;
 		ctx->db->truncate( ctx->db, 0, &count, 0 );
-		return maildir_set_uid( ctx, 0, 0 );
+		return maildir_set_uid( ctx, 0, 0, 0 );
 	}
 #endif /* USE_DB */
 	return maildir_store_uid( ctx );
@@ -485,10 +1567,10 @@ maildir_uidval_lock( maildir_store_t *ctx )
 	/* This (theoretically) works over NFS. Let's hope nobody else did
 	   the same in the opposite order, as we'd deadlock then. */
 #if SEEK_SET != 0
-	lck.l_whence = SEEK_SET;
+	ctx->lck.l_whence = SEEK_SET;
 #endif
-	lck.l_type = F_WRLCK;
-	if (fcntl( ctx->uvfd, F_SETLKW, &lck )) {
+	ctx->lck.l_type = F_WRLCK;
+	if (fcntl( ctx->uvfd, F_SETLKW, &ctx->lck )) {
 		error( "Maildir error: cannot fcntl lock UIDVALIDITY.\n" );
 		return DRV_BOX_BAD;
 	}
@@ -513,52 +1595,136 @@ maildir_uidval_lock( maildir_store_t *ctx )
 static void
 maildir_uidval_unlock( maildir_store_t *ctx )
 {
-	lck.l_type = F_UNLCK;
-	fcntl( ctx->uvfd, F_SETLK, &lck );
+	ctx->lck.l_type = F_UNLCK;
+	fcntl( ctx->uvfd, F_SETLK, &ctx->lck );
 #ifdef LEGACY_FLOCK
 	/* This is legacy only */
 	flock( ctx->uvfd, LOCK_UN );
 #endif
 }
 
+#define MAX_UID_BATCH 1024
+
+/* UIDs are reserved in batches, so .uidvalidity need not be rewritten for
+ * every new message. Makes sure that at least count UIDs are reserved.
+ * Must be called with the UID file locked. */
 static int
-maildir_obtain_uid( maildir_store_t *ctx, int *uid )
+maildir_reserve_uids( maildir_store_t *ctx, int count )
 {
-	*uid = ++ctx->nuid;
-	return maildir_store_uid( ctx );
+	int ret;
+
+	if (ctx->rsvuid + ctx->nrsvuids - 1 != ctx->nuid) {
+		/* Somebody else obtained UIDs after our last reservation. */
+		ctx->rsvuid = ctx->nuid + 1;
+		ctx->nrsvuids = 0;
+	}
+	if (count <= ctx->nrsvuids)
+		return DRV_OK;
+	count -= ctx->nrsvuids;
+	ctx->nuid += count;
+	if ((ret = maildir_store_uid( ctx )) != DRV_OK)
+		return ret;
+	ctx->nrsvuids += count;
+	return DRV_OK;
+}
+
+/* Give back the UIDs which were not used, unless somebody else obtained
+ * UIDs in the meantime. */
+static void
+maildir_release_uids( maildir_store_t *ctx )
+{
+	if (!ctx->nrsvuids)
+		return;
+	if (maildir_uidval_lock( ctx ) == DRV_OK) {
+		if (ctx->nuid == ctx->rsvuid + ctx->nrsvuids - 1) {
+			ctx->nuid = ctx->rsvuid - 1;
+			maildir_store_uid( ctx );
+		}
+		maildir_uidval_unlock( ctx );
+	}
+	ctx->nrsvuids = 0;
 }
 
+/* Must be called with the UID file locked, unless UIDs are reserved. */
 static int
-maildir_compare( const void *l, const void *r )
+maildir_obtain_uid( maildir_store_t *ctx, int *uid )
 {
-	msg_t *lm = (msg_t *)l, *rm = (msg_t *)r;
-	char *ldot, *rdot, *ldot2, *rdot2, *lseq, *rseq;
-	int ret, llen, rlen;
+	int ret;
 
-	if ((ret = lm->uid - rm->uid))
+	if (!ctx->nrsvuids && (ret = maildir_reserve_uids( ctx, 1 )) != DRV_OK)
 		return ret;
+	*uid = ctx->rsvuid++;
+	ctx->nrsvuids--;
+	return DRV_OK;
+}
+
+/* The arrival information in the name of a message without UID, parsed
+ * only once per message for sorting. */
+typedef struct {
+	msg_t msg;
+	int slen; /* length of the seconds field; -1 if there is none */
+	int pid, seq; /* classical "seconds.pid[_seq].host" names */
+	int dlen; /* length of the delivery identifier; -1 if there is none */
+	int hseq, mseq, pseq, qseq; /* numbers following '#', 'M', 'P' and 'Q' in it */
+	int has;
+} msg_key_t;
+
+#define K_HSEQ 1
+#define K_MSEQ 2
+#define K_PSEQ 4
+#define K_QSEQ 8
+
+static void
+maildir_parse_name( msg_key_t *mk )
+{
+	const char *base = mk->msg.base, *dot, *dot2, *seq;
+	char *end;
+
+	mk->slen = mk->dlen = -1;
+	mk->pid = mk->seq = mk->has = 0;
+	if (!(dot = strchr( base, '.' )))
+		return;
+	mk->slen = dot - base;
+	dot++;
+	if ((mk->pid = strtol( dot, &end, 10 )) && *end == '_')
+		mk->seq = atoi( end + 1 );
+	if (!(dot2 = strchr( dot, '.' )))
+		return;
+	mk->dlen = dot2 - dot;
+	if ((seq = memchr( dot, '#', mk->dlen )))
+		mk->has |= K_HSEQ, mk->hseq = atoi( seq + 1 );
+	if ((seq = memchr( dot, 'M', mk->dlen )))
+		mk->has |= K_MSEQ, mk->mseq = atoi( seq + 1 );
+	if ((seq = memchr( dot, 'P', mk->dlen )))
+		mk->has |= K_PSEQ, mk->pseq = atoi( seq + 1 );
+	if ((seq = memchr( dot, 'Q', mk->dlen )))
+		mk->has |= K_QSEQ, mk->qseq = atoi( seq + 1 );
+}
+
+static int
+maildir_compare_keys( const void *l, const void *r )
+{
+	const msg_key_t *lk = (const msg_key_t *)l, *rk = (const msg_key_t *)r;
+	int ret, both;
 
 	/* No UID, so sort by arrival date. We should not do this, but we rely
 	   on the suggested unique file name scheme - we have no choice. */
 	/* The first field are always the seconds. Alphabetical sort should be
 	   faster than numeric. */
-	if (!(ldot = strchr( lm->base, '.' )) || !(rdot = strchr( rm->base, '.' )))
+	if (lk->slen < 0 || rk->slen < 0)
 		goto stronly; /* Should never happen ... */
-	llen = ldot - lm->base, rlen = rdot - rm->base;
 	/* The shorter number is smaller. Really. This won't trigger with any
 	   mail created after Sep 9 2001 anyway. */
-	if ((ret = llen - rlen))
+	if ((ret = lk->slen - rk->slen))
 		return ret;
-	if ((ret = memcmp( lm->base, rm->base, llen )))
+	if ((ret = memcmp( lk->msg.base, rk->msg.base, lk->slen )))
 		return ret;
 
-	ldot++, rdot++;
-
-	if ((llen = strtol( ldot, &ldot2, 10 ))) {
-		if (!(rlen = strtol( rdot, &rdot2, 10 )))
+	if (lk->pid) {
+		if (!rk->pid)
 			goto stronly; /* Comparing apples to oranges ... */
 		/* Classical PID specs */
-		if ((ret = llen - rlen)) {
+		if ((ret = lk->pid - rk->pid)) {
 		  retpid:
 			/* Handle PID wraparound. This works only on systems
 			   where PIDs are not reused too fast */
@@ -566,238 +1732,857 @@ maildir_compare( const void *l, const void *r )
 				ret = -ret;
 			return ret;
 		}
-		return (*ldot2 != '_' ? 0 : atoi( ldot2 + 1 )) -
-		       (*rdot2 != '_' ? 0 : atoi( rdot2 + 1 ));
+		return lk->seq - rk->seq;
 	}
 
-	if (!(ldot2 = strchr( ldot, '.' )) || !(rdot2 = strchr( rdot, '.' )))
+	if (lk->dlen < 0 || rk->dlen < 0)
 		goto stronly; /* Should never happen ... */
-	llen = ldot2 - ldot, rlen = rdot2 - rdot;
-
-	if (((lseq = memchr( ldot, '#', llen )) && (rseq = memchr( rdot, '#', rlen ))) ||
-	    ((lseq = memchr( ldot, 'M', llen )) && (rseq = memchr( rdot, 'M', rlen ))))
-		return atoi( lseq + 1 ) - atoi( rseq + 1 );
 
-	if ((lseq = memchr( ldot, 'P', llen )) && (rseq = memchr( rdot, 'P', rlen ))) {
-		if ((ret = atoi( lseq + 1 ) - atoi( rseq + 1 )))
+	both = lk->has & rk->has;
+	if (both & K_HSEQ)
+		return lk->hseq - rk->hseq;
+	if (both & K_MSEQ)
+		return lk->mseq - rk->mseq;
+	if (both & K_PSEQ) {
+		if ((ret = lk->pseq - rk->pseq))
 			goto retpid;
-		if ((lseq = memchr( ldot, 'Q', llen )) && (rseq = memchr( rdot, 'Q', rlen )))
-			return atoi( lseq + 1 ) - atoi( rseq + 1 );
+		if (both & K_QSEQ)
+			return lk->qseq - rk->qseq;
 	}
 
   stronly:
 	/* Fall-back, so the sort order is defined at all */
-	return strcmp( lm->base, rm->base );
+	return strcmp( lk->msg.base, rk->msg.base );
 }
 
 static int
-maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
+maildir_compare( const void *l, const void *r )
+{
+	msg_t *lm = (msg_t *)l, *rm = (msg_t *)r;
+	msg_key_t lk, rk;
+	int ret;
+
+	if ((ret = lm->uid - rm->uid))
+		return ret;
+	if (lm->uid == INT_MAX)
+		return 0; /* See maildir_sort(). */
+
+	/* Duplicate UID, which is fatal anyway. */
+	lk.msg = *lm;
+	maildir_parse_name( &lk );
+	rk.msg = *rm;
+	maildir_parse_name( &rk );
+	return maildir_compare_keys( &lk, &rk );
+}
+
+/* Messages with UIDs are sorted by them alone. The ones without are sorted
+ * after them, by the arrival information in their names. */
+static void
+maildir_sort( msglist_t *msglist )
+{
+	msg_key_t *keys;
+	int i, n, nkeys;
+
+	qsort( msglist->ents, msglist->nents, sizeof(msg_t), maildir_compare );
+	for (n = msglist->nents; n && msglist->ents[n - 1].uid == INT_MAX; n--);
+	if ((nkeys = msglist->nents - n) < 2)
+		return;
+	keys = nfmalloc( nkeys * sizeof(msg_key_t) );
+	for (i = 0; i < nkeys; i++) {
+		keys[i].msg = msglist->ents[n + i];
+		maildir_parse_name( &keys[i] );
+	}
+	qsort( keys, nkeys, sizeof(msg_key_t), maildir_compare_keys );
+	for (i = 0; i < nkeys; i++)
+		msglist->ents[n + i] = keys[i].msg;
+	free( keys );
+}
+
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+# define st_mtime_nsec(st) ((st)->st_mtim.tv_nsec)
+# define st_ctime_nsec(st) ((st)->st_ctim.tv_nsec)
+#else
+# define st_mtime_nsec(st) 0L
+# define st_ctime_nsec(st) 0L
+#endif
+
+static void
+maildir_get_stamp( struct stat *st, dirstamp_t *ds )
+{
+	ds->mtime = st->st_mtime;
+	ds->mnsec = st_mtime_nsec( st );
+	ds->ctime = st->st_ctime;
+	ds->cnsec = st_ctime_nsec( st );
+	ds->ino = st->st_ino;
+}
+
+static int
+maildir_same_stamp( dirstamp_t *a, dirstamp_t *b )
+{
+	return a->mtime == b->mtime && a->mnsec == b->mnsec &&
+	       a->ctime == b->ctime && a->cnsec == b->cnsec && a->ino == b->ino;
+}
+
+/* Append an entry which takes over the given name. */
+static msg_t *
+maildir_new_ent( msglist_t *msglist, char *base, int uid, int recent, int size )
 {
-	DIR *d;
-	FILE *f;
-	struct dirent *e;
-	const char *u, *ru;
-#ifdef USE_DB
-	DB *tdb;
-	DBC *dbc;
-#endif /* USE_DB */
 	msg_t *entry;
-	int i, j, uid, bl, fnl, ret;
-	time_t now, stamps[2];
-	struct stat st;
-	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
 
-#ifdef USE_DB
-	if (!ctx->db)
-#endif /* USE_DB */
-		if ((ret = maildir_uidval_lock( ctx )) != DRV_OK)
-			return ret;
+	if (msglist->nalloc == msglist->nents) {
+		msglist->nalloc = msglist->nalloc * 2 + 100;
+		msglist->ents = nfrealloc( msglist->ents, msglist->nalloc * sizeof(msg_t) );
+	}
+	entry = &msglist->ents[msglist->nents++];
+	entry->base = base;
+	entry->uid = uid;
+	entry->recent = recent;
+	entry->size = size;
+	entry->tuid[0] = 0;
+	return entry;
+}
 
-  again:
-	msglist->ents = 0;
-	msglist->nents = msglist->nalloc = 0;
-	ctx->gen.count = ctx->gen.recent = 0;
-	if (ctx->uvok || ctx->maxuid == INT_MAX) {
-#ifdef USE_DB
-		if (ctx->db) {
-			if (db_create( &tdb, 0, 0 )) {
-				fputs( "Maildir error: db_create() failed\n", stderr );
-				return DRV_BOX_BAD;
-			}
-			if ((tdb->open)( tdb, 0, 0, 0, DB_HASH, DB_CREATE, 0 )) {
-				fputs( "Maildir error: tdb->open() failed\n", stderr );
-			  bork:
-				tdb->close( tdb, 0 );
-				return DRV_BOX_BAD;
-			}
+static msg_t *
+maildir_add_ent( msglist_t *msglist, const char *name, int uid, int recent, int size )
+{
+	return maildir_new_ent( msglist, nfstrdup( name ), uid, recent, size );
+}
+
+static int
+maildir_name_uid( maildir_store_t *ctx, const char *name )
+{
+	const char *u;
+	int uid;
+
+	uid = (ctx->uvok && (u = strstr( name, ",U=" ))) ? atoi( u + 3 ) : 0;
+	return uid ? uid : INT_MAX;
+}
+
+/* Files stored by us or by Dovecot carry their size in the name. We prefer
+ * the physical size, as that is what stat() would return. */
+static int
+maildir_name_size( const char *name )
+{
+	const char *s;
+
+	if ((s = strstr( name, ",S=" )) || (s = strstr( name, ",W=" )))
+		return atoi( s + 3 );
+	return 0;
+}
+
+/* Count a listed message and add it to the scan if it is within the range
+ * requested by maildir_load(). */
+static msg_t *
+maildir_scan_add( maildir_store_t *ctx, msglist_t *msglist, const char *name, int uid, int recent )
+{
+	int lo, hi, mid;
+
+	ctx->gen.count++;
+	ctx->gen.recent += recent;
+	if (uid > ctx->maxuid)
+		return 0;
+	if (uid < ctx->minuid) {
+		/* The exceptions are sorted by maildir_load(). */
+		for (lo = 0, hi = ctx->nexcs; lo < hi; ) {
+			mid = (lo + hi) / 2;
+			if (ctx->excs[mid] < uid)
+				lo = mid + 1;
+			else
+				hi = mid;
 		}
-#endif /* USE_DB */
-		bl = nfsnprintf( buf, sizeof(buf) - 4, "%s/", ctx->gen.path );
-	  restat:
-		now = time( 0 );
-		for (i = 0; i < 2; i++) {
-			memcpy( buf + bl, subdirs[i], 4 );
-			if (stat( buf, &st )) {
-				sys_error( "Maildir error: cannot stat %s", buf );
-				goto dfail;
-			}
-			if (st.st_mtime == now && !(DFlags & ZERODELAY)) {
-				/* If the modification happened during this second, we wouldn't be able to
-				 * tell if there were further modifications during this second. So wait.
-				 * This has the nice side effect that we wait for "batches" of changes to
-				 * complete. On the downside, it can potentially block indefinitely. */
-				info( "Maildir notice: sleeping due to recent directory modification.\n" );
-				sleep( 1 ); /* FIXME: should make this async */
-				goto restat;
-			}
-			stamps[i] = st.st_mtime;
+		if (lo == ctx->nexcs || ctx->excs[lo] != uid)
+			return 0;
+	}
+	return maildir_add_ent( msglist, name, uid, recent, 0 );
+}
+
+/* Carry over sizes and TUIDs for messages which are in both (sorted) lists. */
+static void
+maildir_merge_info( msglist_t *dst, msglist_t *src )
+{
+	int i, j;
+
+	for (i = j = 0; i < dst->nents && j < src->nents; ) {
+		if (dst->ents[i].uid < src->ents[j].uid) {
+			i++;
+		} else if (dst->ents[i].uid > src->ents[j].uid) {
+			j++;
+		} else {
+			if (dst->ents[i].uid == INT_MAX)
+				break;
+			if (!dst->ents[i].size)
+				dst->ents[i].size = src->ents[j].size;
+			if (!dst->ents[i].tuid[0])
+				memcpy( dst->ents[i].tuid, src->ents[j].tuid, TUIDL );
+			i++, j++;
 		}
-		for (i = 0; i < 2; i++) {
-			memcpy( buf + bl, subdirs[i], 4 );
-			if (!(d = opendir( buf ))) {
-				sys_error( "Maildir error: cannot list %s", buf );
-			  rfail:
-				maildir_free_scan( msglist );
-			  dfail:
-#ifdef USE_DB
-				if (ctx->db)
-					tdb->close( tdb, 0 );
-#endif /* USE_DB */
-				return DRV_BOX_BAD;
-			}
-			while ((e = readdir( d ))) {
-				if (*e->d_name == '.')
+	}
+}
+
+/* The index (.isynccache) is a native-endian dump of the last complete
+ * listing, so it can be mapped and used without parsing. The records are
+ * sorted by UID and followed by the NUL-terminated file names. The flags
+ * are not stored separately, as they are part of the names.
+ * Later changes are appended as deltas, each listing the UIDs of vanished
+ * messages and the records of new and changed ones, and the time stamps
+ * the listing is now valid for. When the deltas grow too big relative to
+ * the dump, the whole index is rewritten. */
+
+#define INDEX_MAGIC "isyncidx"
+#define DELTA_MAGIC "isyncdlt"
+#define INDEX_VERSION 3
+#define MAX_INDEX_DELTAS 16
+
+/* Every part is padded, so the next one is aligned. The padding also
+ * provides the name table's terminating NUL. */
+#define INDEX_ALIGN 8
+#define INDEX_PAD( len ) (((len) + INDEX_ALIGN) & ~(size_t)(INDEX_ALIGN - 1))
+
+typedef struct {
+	char magic[8];
+	int version, reclen, uidvalidity, nents;
+	dirstamp_t stamps[2];
+	unsigned namelen;
+} maildir_index_hdr_t;
+
+typedef struct {
+	char magic[8];
+	int ndel, nadd;
+	dirstamp_t stamps[2];
+	unsigned namelen;
+} maildir_index_delta_t;
+
+typedef struct {
+	int uid, size;
+	unsigned name; /* offset into the name table */
+	char recent;
+	char tuid[TUIDL];
+} maildir_index_rec_t;
+
+static int
+maildir_index_ent( msglist_t *msglist, const maildir_index_rec_t *rec, char *names, unsigned namelen )
+{
+	msg_t *entry;
+
+	if (rec->name >= namelen || (unsigned char)rec->recent > 1 || rec->uid <= 0 || rec->uid == INT_MAX)
+		return -1;
+	entry = maildir_new_ent( msglist, names + rec->name, rec->uid, rec->recent, rec->size );
+	memcpy( entry->tuid, rec->tuid, TUIDL );
+	return 0;
+}
+
+/* Merge a delta into the (sorted) cache. All names are in the mapping. */
+static int
+maildir_apply_delta( msglist_t *cache, const maildir_index_delta_t *dlt )
+{
+	const int *dels = (const int *)(dlt + 1);
+	const maildir_index_rec_t *recs = (const maildir_index_rec_t *)(dels + dlt->ndel);
+	char *names = (char *)(recs + dlt->nadd);
+	msglist_t nl;
+	int i, d, a, uid, puid;
+
+	if (names[dlt->namelen - 1])
+		return -1;
+	nl.nents = 0;
+	nl.nalloc = cache->nents + dlt->nadd;
+	nl.ents = nfmalloc( (nl.nalloc ? nl.nalloc : 1) * sizeof(msg_t) );
+	nl.shared = cache->shared;
+	nl.shared_end = cache->shared_end;
+	for (i = d = a = 0, puid = 0; i < cache->nents || a < dlt->nadd; ) {
+		if (a < dlt->nadd && (i == cache->nents || recs[a].uid <= (int)cache->ents[i].uid)) {
+			if (recs[a].uid <= puid || maildir_index_ent( &nl, &recs[a], names, dlt->namelen ))
+				goto bad;
+			puid = recs[a].uid;
+			/* A changed message replaces the old entry. */
+			if (i < cache->nents && (int)cache->ents[i].uid == puid)
+				i++;
+			a++;
+		} else {
+			uid = cache->ents[i].uid;
+			for (; d < dlt->ndel && dels[d] < uid; d++);
+			if (d == dlt->ndel || dels[d] != uid)
+				nl.ents[nl.nents++] = cache->ents[i];
+			i++;
+		}
+	}
+	free( cache->ents );
+	*cache = nl;
+	return 0;
+
+  bad:
+	free( nl.ents );
+	return -1;
+}
+
+/* The index is an optimization only, so any failure to read or
+ * write it is silently ignored. The mapping is kept while the box
+ * is open, and the cached entries refer to the names in it. */
+static void
+maildir_read_cache( maildir_store_t *ctx )
+{
+	maildir_index_hdr_t *hdr;
+	maildir_index_delta_t *dlt;
+	maildir_index_rec_t *rec;
+	dirstamp_t *stamps;
+	char *map, *names;
+	size_t off, len;
+	int fd, i, ndeltas;
+	struct stat st;
+	char buf[_POSIX_PATH_MAX];
+
+	ctx->cache_read = 1;
+	nfsnprintf( buf, sizeof(buf), "%s/.isynccache", ctx->gen.path );
+	if ((fd = open( buf, O_RDONLY )) < 0)
+		return;
+	if (fstat( fd, &st ) || st.st_size < (off_t)sizeof(*hdr) ||
+	    (map = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 )) == MAP_FAILED) {
+		close( fd );
+		return;
+	}
+	close( fd );
+	hdr = (maildir_index_hdr_t *)map;
+	if (memcmp( hdr->magic, INDEX_MAGIC, 8 ) || hdr->version != INDEX_VERSION ||
+	    hdr->reclen != sizeof(*rec) || hdr->uidvalidity != ctx->gen.uidvalidity ||
+	    hdr->nents < 0 || (size_t)hdr->nents > (size_t)st.st_size / sizeof(*rec) || !hdr->namelen)
+		goto bad;
+	off = sizeof(*hdr) + (size_t)hdr->nents * sizeof(*rec) + hdr->namelen;
+	if (off % INDEX_ALIGN || (off_t)off > st.st_size)
+		goto bad;
+	rec = (maildir_index_rec_t *)(hdr + 1);
+	names = (char *)(rec + hdr->nents);
+	if (names[hdr->namelen - 1])
+		goto bad;
+	ctx->cache.ents = nfmalloc( (hdr->nents ? hdr->nents : 1) * sizeof(msg_t) );
+	ctx->cache.nalloc = hdr->nents;
+	/* The deltas' names are in this range as well. */
+	ctx->cache.shared = names;
+	ctx->cache.shared_end = map + st.st_size;
+	for (i = 0; i < hdr->nents; i++, rec++)
+		if (maildir_index_ent( &ctx->cache, rec, names, hdr->namelen ))
+			goto bad;
+	ctx->index_base = off;
+	stamps = hdr->stamps;
+	for (ndeltas = 0; (off_t)off < st.st_size; off += len, ndeltas++) {
+		dlt = (maildir_index_delta_t *)(map + off);
+		if ((size_t)st.st_size - off < sizeof(*dlt) || memcmp( dlt->magic, DELTA_MAGIC, 8 ) ||
+		    dlt->ndel < 0 || dlt->nadd < 0 || !dlt->namelen ||
+		    (size_t)dlt->ndel + (size_t)dlt->nadd > (size_t)st.st_size / sizeof(int))
+			goto bad;
+		len = sizeof(*dlt) + (size_t)dlt->ndel * sizeof(int) + (size_t)dlt->nadd * sizeof(*rec) + dlt->namelen;
+		if (len % INDEX_ALIGN || len > (size_t)st.st_size - off || maildir_apply_delta( &ctx->cache, dlt ))
+			goto bad;
+		stamps = dlt->stamps;
+	}
+	memcpy( ctx->cache_stamps, stamps, sizeof(ctx->cache_stamps) );
+	ctx->index_map = map;
+	ctx->index_len = st.st_size;
+	ctx->index_ino = st.st_ino;
+	ctx->index_size = st.st_size;
+	ctx->index_deltas = ndeltas;
+	ctx->cache_ok = 1;
+	return;
+
+  bad:
+	maildir_free_scan( &ctx->cache );
+	memset( &ctx->cache, 0, sizeof(ctx->cache) );
+	munmap( map, st.st_size );
+}
+
+static void
+maildir_fill_rec( maildir_index_rec_t *rec, const msg_t *entry, unsigned name )
+{
+	rec->uid = entry->uid;
+	rec->size = entry->size;
+	rec->recent = entry->recent;
+	memcpy( rec->tuid, entry->tuid, TUIDL );
+	rec->name = name;
+}
+
+static void
+maildir_rewrite_cache( maildir_store_t *ctx )
+{
+	maildir_index_hdr_t *hdr;
+	maildir_index_rec_t *rec;
+	char *data, *names;
+	size_t len, off;
+	int fd, i, ok;
+	struct stat st;
+	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
+
+	ctx->index_size = 0;
+	for (len = 1, i = 0; i < ctx->cache.nents; i++)
+		len += strlen( ctx->cache.ents[i].base ) + 1;
+	off = sizeof(*hdr) + ctx->cache.nents * sizeof(*rec);
+	len = INDEX_PAD( off + len ) - off;
+	data = nfcalloc( off + len );
+	hdr = (maildir_index_hdr_t *)data;
+	memcpy( hdr->magic, INDEX_MAGIC, 8 );
+	hdr->version = INDEX_VERSION;
+	hdr->reclen = sizeof(*rec);
+	hdr->uidvalidity = ctx->gen.uidvalidity;
+	hdr->nents = ctx->cache.nents;
+	memcpy( hdr->stamps, ctx->cache_stamps, sizeof(hdr->stamps) );
+	hdr->namelen = len;
+	rec = (maildir_index_rec_t *)(hdr + 1);
+	names = data + off;
+	for (len = 1, i = 0; i < ctx->cache.nents; i++, rec++) {
+		maildir_fill_rec( rec, &ctx->cache.ents[i], len );
+		len += strlen( strcpy( names + len, ctx->cache.ents[i].base ) ) + 1;
+	}
+	len = hdr->namelen;
+
+	nfsnprintf( buf, sizeof(buf), "%s/.isynccache.new", ctx->gen.path );
+	if ((fd = open( buf, O_WRONLY|O_CREAT|O_TRUNC, 0600 )) < 0) {
+		free( data );
+		return;
+	}
+	ok = write( fd, data, off + len ) == (ssize_t)(off + len) && !fstat( fd, &st );
+	free( data );
+	if (close( fd ) || !ok) {
+		unlink( buf );
+		return;
+	}
+	nfsnprintf( nbuf, sizeof(nbuf), "%s/.isynccache", ctx->gen.path );
+	if (rename( buf, nbuf )) {
+		unlink( buf );
+		return;
+	}
+	ctx->index_ino = st.st_ino;
+	ctx->index_size = ctx->index_base = off + len;
+	ctx->index_deltas = 0;
+}
+
+/* Append a delta to the index, unless it is time to rewrite it. The file
+ * must still be the one this process wrote or read last. */
+static int
+maildir_append_cache( maildir_store_t *ctx, const int *dels, int ndel, msg_t **adds, int nadd )
+{
+	maildir_index_delta_t *dlt;
+	maildir_index_rec_t *rec;
+	char *data, *names;
+	size_t len, off;
+	int fd, i, ok;
+	struct stat st;
+	char buf[_POSIX_PATH_MAX];
+
+	if (ctx->index_deltas >= MAX_INDEX_DELTAS)
+		return -1;
+	for (len = 0, i = 0; i < nadd; i++)
+		len += strlen( adds[i]->base ) + 1;
+	off = sizeof(*dlt) + ndel * sizeof(int) + nadd * sizeof(*rec);
+	len = INDEX_PAD( off + len ) - off;
+	if ((size_t)(ctx->index_size - ctx->index_base) + off + len > (size_t)ctx->index_base / 2)
+		return -1;
+	data = nfcalloc( off + len );
+	dlt = (maildir_index_delta_t *)data;
+	memcpy( dlt->magic, DELTA_MAGIC, 8 );
+	dlt->ndel = ndel;
+	dlt->nadd = nadd;
+	memcpy( dlt->stamps, ctx->cache_stamps, sizeof(dlt->stamps) );
+	dlt->namelen = len;
+	memcpy( dlt + 1, dels, ndel * sizeof(int) );
+	rec = (maildir_index_rec_t *)((int *)(dlt + 1) + ndel);
+	names = data + off;
+	for (len = 0, i = 0; i < nadd; i++, rec++) {
+		maildir_fill_rec( rec, adds[i], len );
+		len += strlen( strcpy( names + len, adds[i]->base ) ) + 1;
+	}
+	len = dlt->namelen;
+
+	nfsnprintf( buf, sizeof(buf), "%s/.isynccache", ctx->gen.path );
+	if ((fd = open( buf, O_WRONLY )) < 0) {
+		free( data );
+		return -1;
+	}
+	ok = !fstat( fd, &st ) && st.st_ino == ctx->index_ino && st.st_size == ctx->index_size &&
+	     pwrite( fd, data, off + len, ctx->index_size ) == (ssize_t)(off + len);
+	free( data );
+	if (close( fd ) || !ok)
+		return -1;
+	ctx->index_size += off + len;
+	ctx->index_deltas++;
+	return 0;
+}
+
+static int
+maildir_same_ent( const msg_t *a, const msg_t *b )
+{
+	return a->recent == b->recent && a->size == b->size &&
+	       !memcmp( a->tuid, b->tuid, TUIDL ) && !strcmp( a->base, b->base );
+}
+
+/* Save the cache, which replaced the old listing. Only what changed
+ * is written, if the index on disk still holds the old listing. */
+static void
+maildir_write_cache( maildir_store_t *ctx, msglist_t *old )
+{
+	msg_t *ne, *oe, **adds;
+	int *dels, i, j, ndel, nadd, ret;
+
+	if (old && ctx->index_size) {
+		dels = nfmalloc( (old->nents + 1) * sizeof(int) );
+		adds = nfmalloc( (ctx->cache.nents + 1) * sizeof(msg_t *) );
+		for (i = j = ndel = nadd = 0; i < ctx->cache.nents || j < old->nents; ) {
+			ne = (i < ctx->cache.nents) ? &ctx->cache.ents[i] : 0;
+			oe = (j < old->nents) ? &old->ents[j] : 0;
+			if (!ne || (oe && oe->uid < ne->uid)) {
+				dels[ndel++] = oe->uid;
+				j++;
+			} else if (!oe || ne->uid < oe->uid) {
+				adds[nadd++] = ne;
+				i++;
+			} else {
+				if (!maildir_same_ent( ne, oe ))
+					adds[nadd++] = ne;
+				i++, j++;
+			}
+		}
+		ret = maildir_append_cache( ctx, dels, ndel, adds, nadd );
+		free( dels );
+		free( adds );
+		if (!ret)
+			return;
+	}
+	maildir_rewrite_cache( ctx );
+}
+
+/* The messages we store are recorded in the index along with their TUIDs,
+ * so they can be found after an interrupted run without being read. With
+ * the alternative scheme, the UID map does that already. The index is
+ * updated once the current round of events is processed. */
+static void
+maildir_note_stored( maildir_store_t *ctx, int ddfd, const char *name, int uid, const char *tuid )
+{
+	msg_t *entry;
+
+	if (uid <= 0 || !tuid[0])
+		return;
+#ifdef USE_DB
+	if (ctx->db)
+		return;
+#endif /* USE_DB */
+	entry = maildir_add_ent( &ctx->stored, name, uid, ddfd == ctx->dfds[1], maildir_name_size( name ) );
+	memcpy( entry->tuid, tuid, TUIDL );
+	conf_wakeup( &ctx->flush_wakeup, 0 );
+}
+
+static void
+maildir_save_stored( maildir_store_t *ctx )
+{
+	msglist_t nl;
+	msg_t **adds;
+	int i, j, nadd;
+
+	if (!ctx->stored.nents)
+		return;
+	if (!ctx->cache_read)
+		maildir_read_cache( ctx );
+	if (!ctx->cache_ok) {
+		/* These time stamps never match, so the directories will be
+		 * listed again, and only the TUIDs are taken from the index. */
+		maildir_free_scan( &ctx->cache );
+		memset( &ctx->cache, 0, sizeof(ctx->cache) );
+		memset( ctx->cache_stamps, 0, sizeof(ctx->cache_stamps) );
+		ctx->cache_ok = 1;
+		ctx->index_size = 0;
+	}
+	maildir_sort( &ctx->stored );
+	nl.nents = 0;
+	nl.nalloc = ctx->cache.nents + ctx->stored.nents;
+	nl.ents = nfmalloc( nl.nalloc * sizeof(msg_t) );
+	nl.shared = ctx->cache.shared;
+	nl.shared_end = ctx->cache.shared_end;
+	adds = nfmalloc( ctx->stored.nents * sizeof(msg_t *) );
+	for (i = j = nadd = 0; i < ctx->cache.nents || j < ctx->stored.nents; ) {
+		if (j < ctx->stored.nents && (i == ctx->cache.nents || ctx->stored.ents[j].uid <= ctx->cache.ents[i].uid)) {
+			if (i < ctx->cache.nents && ctx->cache.ents[i].uid == ctx->stored.ents[j].uid) {
+				if (!maildir_ent_shared( &ctx->cache, ctx->cache.ents[i].base ))
+					free( ctx->cache.ents[i].base );
+				i++;
+			}
+			/* The entry takes over the name. */
+			adds[nadd++] = &nl.ents[nl.nents];
+			nl.ents[nl.nents++] = ctx->stored.ents[j++];
+		} else {
+			nl.ents[nl.nents++] = ctx->cache.ents[i++];
+		}
+	}
+	free( ctx->cache.ents );
+	ctx->cache = nl;
+	free( ctx->stored.ents );
+	memset( &ctx->stored, 0, sizeof(ctx->stored) );
+	if (!ctx->index_size || maildir_append_cache( ctx, 0, 0, adds, nadd ))
+		maildir_rewrite_cache( ctx );
+	free( adds );
+}
+
+/* Sub-second time stamps are usually derived from the kernel's tick, so
+ * they may not change for a few milliseconds. */
+#define MTIME_GRAIN 20000 /* microseconds */
+
+/* If the directory was modified so recently that further modifications might
+ * leave its time stamp unchanged, return the number of milliseconds to wait. */
+static int
+maildir_mtime_wait( struct stat *st, struct timeval *now )
+{
+	long d;
+
+	if (st_mtime_nsec( st )) {
+		if (now->tv_sec - st->st_mtime > 1 || now->tv_sec < st->st_mtime)
+			return 0;
+		d = (now->tv_sec - st->st_mtime) * 1000000 + now->tv_usec - st_mtime_nsec( st ) / 1000;
+		return d < MTIME_GRAIN ? (MTIME_GRAIN - d + 999) / 1000 : 0;
+	}
+	/* No sub-second resolution (or a very unlikely time stamp). */
+	if (st->st_mtime == now->tv_sec)
+		return (1000000 - now->tv_usec + 999) / 1000;
+	return 0;
+}
+
+/* Find the X-TUID header, reading the file in big chunks instead of
+ * line by line. The header is usually found in the first chunk. */
+static void
+maildir_read_tuid( int fd, char *tuid )
+{
+	char *p, *e;
+	off_t off = 0;
+	int len, keep = 1;
+	char buf[4096];
+
+	buf[0] = '\n';
+	for (;;) {
+		if ((len = pread( fd, buf + keep, sizeof(buf) - keep, off )) <= 0)
+			return;
+		off += len;
+		e = buf + keep + len;
+		for (p = buf; (p = memchr( p, '\n', e - p )); p++) {
+			if (e - p < 10 + TUIDL)
+				break; /* Possibly incomplete line; look at it again with the next chunk. */
+			if (p[1] == '\n')
+				return;
+			if (!memcmp( p + 1, "X-TUID: ", 8 ) && p[9 + TUIDL] == '\n') {
+				memcpy( tuid, p + 9, TUIDL );
+				return;
+			}
+		}
+		if ((keep = p ? e - p : 0))
+			memmove( buf, p, keep );
+	}
+}
+
+/* If delay is non-null and the scan needs to be retried later, nothing is
+ * listed, and *delay is set to the number of milliseconds to wait.
+ * Rescans (delay is null) only look up messages which are loaded already, so
+ * they don't wait; the listing is just not cached then. A modification which
+ * goes unnoticed makes a message look vanished until the next run at worst. */
+static int
+maildir_scan( maildir_store_t *ctx, msglist_t *msglist, int *delay )
+{
+	DIR *d;
+	struct dirent *e;
+	const char *u, *ru;
+	msg_t *entry, *sent;
+	msglist_t full, old;
+#ifdef USE_DB
+	char tuid[TUIDL];
+#endif /* USE_DB */
+	int i, j, uid, bl, fnl, fd, ret, wait, relisted, updated, cacheable, nnew;
+	dirstamp_t stamps[2];
+	struct timeval now;
+	struct stat st;
+	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
+
+#ifdef USE_DB
+	if (!ctx->db)
+#endif /* USE_DB */
+		if ((ret = maildir_uidval_lock( ctx )) != DRV_OK)
+			return ret;
+
+	if (!ctx->cache_read)
+		maildir_read_cache( ctx );
+	maildir_save_stored( ctx );
+
+  again:
+	msglist->ents = 0;
+	msglist->nents = msglist->nalloc = 0;
+	msglist->shared = msglist->shared_end = 0;
+	full.ents = 0;
+	full.nents = full.nalloc = 0;
+	/* The names from the mapped index can be shared, as it outlives the listings. */
+	full.shared = ctx->cache.shared;
+	full.shared_end = ctx->cache.shared_end;
+	relisted = updated = 0;
+	cacheable = ctx->uvok;
+	ctx->gen.count = ctx->gen.recent = 0;
+	if (ctx->uvok || ctx->maxuid == INT_MAX) {
+		bl = nfsnprintf( buf, sizeof(buf) - 4, "%s/", ctx->gen.path );
+		gettimeofday( &now, 0 );
+		for (i = 0; i < 2; i++) {
+			memcpy( buf + bl, subdirs[i], 4 );
+			if (fstat( ctx->dfds[i], &st )) {
+				sys_error( "Maildir error: cannot stat %s", buf );
+				return DRV_BOX_BAD;
+			}
+			if ((wait = maildir_mtime_wait( &st, &now )))
+				cacheable = 0;
+			if (wait && delay && !(DFlags & ZERODELAY)) {
+				/* If the modification happened just now, we wouldn't be able to
+				 * tell if there were further modifications right after it. So wait.
+				 * This has the nice side effect that we wait for "batches" of changes to
+				 * complete. On the downside, it can potentially delay indefinitely. */
+				debug( "Maildir notice: delaying scan by %dms due to recent directory modification.\n", wait );
+#ifdef USE_DB
+				if (!ctx->db)
+#endif /* USE_DB */
+					maildir_uidval_unlock( ctx );
+				*delay = wait;
+				return DRV_OK;
+			}
+			maildir_get_stamp( &st, &stamps[i] );
+			if (!ctx->cache_ok || !maildir_same_stamp( &ctx->cache_stamps[i], &stamps[i] ))
+				relisted |= 1 << i;
+		}
+		for (i = 0; i < 2; i++) {
+			if (!(relisted & (1 << i))) {
+				/* Not modified since the index was made, so don't list it.
+				 * If neither was, the whole cache is taken over at once, as
+				 * it is sorted already. */
+				if (!relisted && i)
+					continue;
+				for (j = 0; j < ctx->cache.nents; j++) {
+					sent = &ctx->cache.ents[j];
+					if (relisted && sent->recent != i)
+						continue;
+					entry = maildir_new_ent( &full, maildir_ent_shared( &full, sent->base ) ? sent->base : nfstrdup( sent->base ),
+					                         sent->uid, sent->recent, sent->size );
+					memcpy( entry->tuid, sent->tuid, TUIDL );
+				}
+				continue;
+			}
+			memcpy( buf + bl, subdirs[i], 4 );
+			/* The directory stream needs its own file offset. */
+			if ((fd = openat( ctx->dfds[i], ".", O_RDONLY|O_DIRECTORY )) < 0 || !(d = fdopendir( fd ))) {
+				sys_error( "Maildir error: cannot list %s", buf );
+				if (fd >= 0)
+					close( fd );
+			  bork:
+				maildir_free_scan( &full );
+				return DRV_BOX_BAD;
+			}
+			while ((e = readdir( d ))) {
+				if (*e->d_name == '.')
 					continue;
-				ctx->gen.count++;
-				ctx->gen.recent += i;
 #ifdef USE_DB
 				if (ctx->db) {
-					make_key( &key, e->d_name );
-					if ((ret = ctx->db->get( ctx->db, 0, &key, &value, 0 ))) {
+					make_key( &ctx->key, e->d_name );
+					if ((ret = ctx->db->get( ctx->db, 0, &ctx->key, &ctx->value, 0 ))) {
 						if (ret != DB_NOTFOUND) {
 							ctx->db->err( ctx->db, ret, "Maildir error: db->get()" );
-						  mbork:
-							maildir_free_scan( msglist );
+							closedir( d );
 							goto bork;
 						}
 						uid = INT_MAX;
+						tuid[0] = 0;
 					} else {
-						value.size = 0;
-						if ((ret = tdb->put( tdb, 0, &key, &value, 0 ))) {
-							tdb->err( tdb, ret, "Maildir error: tdb->put()" );
-							goto mbork;
-						}
-						uid = *(int *)value.data;
+						if (ctx->value.size == sizeof(int) + TUIDL)
+							memcpy( tuid, (char *)ctx->value.data + sizeof(int), TUIDL );
+						else
+							tuid[0] = 0;
+						uid = *(int *)ctx->value.data;
 					}
+					entry = maildir_add_ent( &full, e->d_name, uid, i, 0 );
+					memcpy( entry->tuid, tuid, TUIDL );
 				} else
 #endif /* USE_DB */
-				{
-					uid = (ctx->uvok && (u = strstr( e->d_name, ",U=" ))) ? atoi( u + 3 ) : 0;
-					if (!uid)
-						uid = INT_MAX;
-				}
-				if (uid <= ctx->maxuid) {
-					if (uid < ctx->minuid) {
-						for (j = 0; j < ctx->nexcs; j++)
-							if (ctx->excs[j] == uid)
-								goto oke;
-						continue;
-					  oke: ;
-					}
-					if (msglist->nalloc == msglist->nents) {
-						msglist->nalloc = msglist->nalloc * 2 + 100;
-						msglist->ents = nfrealloc( msglist->ents, msglist->nalloc * sizeof(msg_t) );
-					}
-					entry = &msglist->ents[msglist->nents++];
-					entry->base = nfstrdup( e->d_name );
-					entry->uid = uid;
-					entry->recent = i;
-					entry->size = 0;
-					entry->tuid[0] = 0;
-				}
+					maildir_add_ent( &full, e->d_name, maildir_name_uid( ctx, e->d_name ), i, 0 );
 			}
 			closedir( d );
 		}
 		for (i = 0; i < 2; i++) {
 			memcpy( buf + bl, subdirs[i], 4 );
-			if (stat( buf, &st )) {
+			if (fstat( ctx->dfds[i], &st )) {
 				sys_error( "Maildir error: cannot re-stat %s", buf );
-				goto rfail;
+				goto bork;
 			}
-			if (st.st_mtime != stamps[i]) {
+			if (st.st_mtime != stamps[i].mtime || st_mtime_nsec( &st ) != stamps[i].mnsec) {
 				/* Somebody messed with the mailbox since we started listing it. */
-#ifdef USE_DB
-				if (ctx->db)
-					tdb->close( tdb, 0 );
-#endif /* USE_DB */
-				maildir_free_scan( msglist );
+				maildir_free_scan( &full );
 				goto again;
 			}
 		}
 #ifdef USE_DB
-		if (ctx->db) {
-			if ((ret = ctx->db->cursor( ctx->db, 0, &dbc, 0 )))
-				ctx->db->err( ctx->db, ret, "Maildir error: db->cursor()" );
-			else {
-				for (;;) {
-					if ((ret = dbc->c_get( dbc, &key, &value, DB_NEXT ))) {
-						if (ret != DB_NOTFOUND)
-							ctx->db->err( ctx->db, ret, "Maildir error: db->c_get()" );
-						break;
-					}
-					if ((key.size != 11 || memcmp( key.data, "UIDVALIDITY", 11 )) &&
-					    (ret = tdb->get( tdb, 0, &key, &value, 0 ))) {
-						if (ret != DB_NOTFOUND) {
-							tdb->err( tdb, ret, "Maildir error: tdb->get()" );
-							break;
-						}
-						if ((ret = dbc->c_del( dbc, 0 ))) {
-							ctx->db->err( ctx->db, ret, "Maildir error: db->c_del()" );
-							break;
-						}
-					}
-				}
-				dbc->c_close( dbc );
+		/* Stale entries can exist only if something was actually listed. */
+		if (ctx->db && relisted)
+			maildir_purge_uids( ctx, &full );
+#endif /* USE_DB */
+		if (relisted) {
+			maildir_sort( &full );
+			if (ctx->cache_ok)
+				maildir_merge_info( &full, &ctx->cache );
+		}
+		/* The full listing is sorted already, and so is its subset. */
+		for (j = 0; j < full.nents; j++) {
+			entry = &full.ents[j];
+			if (entry->uid == INT_MAX)
+				cacheable = 0;
+			if ((sent = maildir_scan_add( ctx, msglist, entry->base, entry->uid, entry->recent ))) {
+				sent->size = entry->size;
+				memcpy( sent->tuid, entry->tuid, TUIDL );
 			}
-			tdb->close( tdb, 0 );
 		}
+		/* The messages without UID are at the end. Get UIDs for all of them at once. */
+		for (j = msglist->nents; j && msglist->ents[j - 1].uid == INT_MAX; j--);
+		nnew = msglist->nents - j;
+#ifdef USE_DB
+		if (!ctx->db)
 #endif /* USE_DB */
-		qsort( msglist->ents, msglist->nents, sizeof(msg_t), maildir_compare );
+			if (nnew > ctx->nrsvuids && (ret = maildir_reserve_uids( ctx, nnew )) != DRV_OK) {
+				maildir_free_scan( msglist );
+				maildir_free_scan( &full );
+				return ret;
+			}
 		for (uid = i = 0; i < msglist->nents; i++) {
 			entry = &msglist->ents[i];
+			if ((ctx->gen.opts & OPEN_SIZE) && !entry->size)
+				entry->size = maildir_name_size( entry->base );
 			if (entry->uid != INT_MAX) {
 				if (uid == entry->uid) {
 #if 1
 					/* See comment in maildir_uidval_lock() why this is fatal. */
 					error( "Maildir error: duplicate UID %d.\n", uid );
 					maildir_free_scan( msglist );
+					maildir_free_scan( &full );
 					return DRV_BOX_BAD;
 #else
 					info( "Maildir notice: duplicate UID; changing UIDVALIDITY.\n");
 					if ((ret = maildir_init_uid( ctx )) != DRV_OK) {
 						maildir_free_scan( msglist );
+						maildir_free_scan( &full );
 						return ret;
 					}
 					maildir_free_scan( msglist );
+					maildir_free_scan( &full );
 					goto again;
 #endif
 				}
 				uid = entry->uid;
-				if ((ctx->gen.opts & OPEN_SIZE) || ((ctx->gen.opts & OPEN_FIND) && uid >= ctx->newuid))
+				if (((ctx->gen.opts & OPEN_SIZE) && !entry->size) || ((ctx->gen.opts & OPEN_FIND) && uid >= ctx->newuid && !entry->tuid[0]))
 					nfsnprintf( buf + bl, sizeof(buf) - bl, "%s/%s", subdirs[entry->recent], entry->base );
 #ifdef USE_DB
 			} else if (ctx->db) {
-				if ((ret = maildir_set_uid( ctx, entry->base, &uid )) != DRV_OK) {
+				if ((ret = maildir_put_uid( ctx, entry->base, &uid, 0 )) != DRV_OK) {
 					maildir_free_scan( msglist );
+					maildir_free_scan( &full );
 					return ret;
 				}
 				entry->uid = uid;
-				if ((ctx->gen.opts & OPEN_SIZE) || ((ctx->gen.opts & OPEN_FIND) && uid >= ctx->newuid))
+				if (((ctx->gen.opts & OPEN_SIZE) && !entry->size) || ((ctx->gen.opts & OPEN_FIND) && uid >= ctx->newuid && !entry->tuid[0]))
 					nfsnprintf( buf + bl, sizeof(buf) - bl, "%s/%s", subdirs[entry->recent], entry->base );
 #endif /* USE_DB */
 			} else {
 				if ((ret = maildir_obtain_uid( ctx, &uid )) != DRV_OK) {
 					maildir_free_scan( msglist );
+					maildir_free_scan( &full );
 					return ret;
 				}
 				entry->uid = uid;
@@ -811,23 +2596,25 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 					+ 1 - 4;
 				memcpy( nbuf, buf, bl + 4 );
 				nfsnprintf( nbuf + bl + 4, sizeof(nbuf) - bl - 4, "%s", entry->base );
-				if (rename( nbuf, buf )) {
+				if (renameat( ctx->dfds[entry->recent], nbuf + bl + 4, ctx->dfds[entry->recent], buf + bl + 4 )) {
 					if (errno != ENOENT) {
 						sys_error( "Maildir error: cannot rename %s to %s", nbuf, buf );
 					  fail:
 						maildir_free_scan( msglist );
+						maildir_free_scan( &full );
 						return DRV_BOX_BAD;
 					}
 				  retry:
 					maildir_free_scan( msglist );
+					maildir_free_scan( &full );
 					goto again;
 				}
 				free( entry->base );
 				entry->base = nfmalloc( fnl );
 				memcpy( entry->base, buf + bl + 4, fnl );
 			}
-			if (ctx->gen.opts & OPEN_SIZE) {
-				if (stat( buf, &st )) {
+			if ((ctx->gen.opts & OPEN_SIZE) && !entry->size) {
+				if (fstatat( ctx->dfds[entry->recent], buf + bl + 4, &st, 0 )) {
 					if (errno != ENOENT) {
 						sys_error( "Maildir error: cannot stat %s", buf );
 						goto fail;
@@ -835,32 +2622,55 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 					goto retry;
 				}
 				entry->size = st.st_size;
+				updated = 1;
 			}
-			if ((ctx->gen.opts & OPEN_FIND) && uid >= ctx->newuid) {
-				if (!(f = fopen( buf, "r" ))) {
+			if ((ctx->gen.opts & OPEN_FIND) && uid >= ctx->newuid && !entry->tuid[0]) {
+				if ((fd = openat( ctx->dfds[entry->recent], buf + bl + 4, O_RDONLY )) < 0) {
 					if (errno != ENOENT) {
 						sys_error( "Maildir error: cannot open %s", buf );
 						goto fail;
 					}
 					goto retry;
 				}
-				while (fgets( nbuf, sizeof(nbuf), f )) {
-					if (!nbuf[0] || nbuf[0] == '\n')
-						break;
-					if (!memcmp( nbuf, "X-TUID: ", 8 ) && nbuf[8 + TUIDL] == '\n') {
-						memcpy( entry->tuid, nbuf + 8, TUIDL );
-						break;
-					}
-				}
-				fclose( f );
+				maildir_read_tuid( fd, entry->tuid );
+				close( fd );
+				updated = 1;
 			}
 		}
+#ifdef USE_DB
+		if (ctx->db && nnew && (ret = maildir_sync_uids( ctx )) != DRV_OK) {
+			maildir_free_scan( msglist );
+			maildir_free_scan( &full );
+			return ret;
+		}
+#endif /* USE_DB */
+		if (cacheable) {
+			/* Entries with a known UID are never renamed above, so
+			 * the listing is still accurate. */
+			maildir_merge_info( &full, msglist );
+			old = ctx->cache;
+			ctx->cache = full;
+			memcpy( ctx->cache_stamps, stamps, sizeof(stamps) );
+			if (relisted || updated)
+				maildir_write_cache( ctx, ctx->cache_ok ? &old : 0 );
+			ctx->cache_ok = 1;
+			maildir_free_scan( &old );
+		} else {
+			maildir_free_scan( &ctx->cache );
+			maildir_free_scan( &full );
+			memset( &ctx->cache, 0, sizeof(ctx->cache) );
+			ctx->cache_ok = 0;
+			/* The index does not match the cache anymore. */
+			ctx->index_size = 0;
+		}
 		ctx->uvok = 1;
 	}
 #ifdef USE_DB
 	if (!ctx->db)
 #endif /* ! USE_DB */
 		maildir_uidval_unlock( ctx );
+	if (delay)
+		*delay = 0;
 	return DRV_OK;
 }
 
@@ -871,6 +2681,7 @@ maildir_init_msg( maildir_store_t *ctx, maildir_message_t *msg, msg_t *entry )
 	entry->base = 0; /* prevent deletion */
 	msg->gen.size = entry->size;
 	msg->gen.srec = 0;
+	msg->gen.msgid = 0;
 	strncpy( msg->gen.tuid, entry->tuid, TUIDL );
 	if (entry->recent)
 		msg->gen.status |= M_RECENT;
@@ -898,7 +2709,7 @@ maildir_select( store_t *gctx, int create,
                 void (*cb)( int sts, void *aux ), void *aux )
 {
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
-	int ret;
+	int i, ret;
 #ifdef USE_DB
 	struct stat st;
 #endif /* USE_DB */
@@ -908,6 +2719,8 @@ maildir_select( store_t *gctx, int create,
 	gctx->msgs = 0;
 	ctx->excs = 0;
 	ctx->uvfd = -1;
+	ctx->dfds[0] = ctx->dfds[1] = ctx->dfds[2] = -1;
+	ctx->nrsvuids = ctx->uidbatch = 0;
 #ifdef USE_DB
 	ctx->db = 0;
 #endif /* USE_DB */
@@ -920,6 +2733,16 @@ maildir_select( store_t *gctx, int create,
 		cb( ret, aux );
 		return;
 	}
+	/* The subdirectories are accessed relative to these, which saves
+	 * looking up the full path each time. */
+	for (i = 0; i < 3; i++) {
+		nfsnprintf( uvpath, sizeof(uvpath), "%s/%s", gctx->path, subdirs[i] );
+		if ((ctx->dfds[i] = open( uvpath, O_RDONLY|O_DIRECTORY )) < 0) {
+			sys_error( "Maildir error: cannot open %s", uvpath );
+			cb( DRV_BOX_BAD, aux );
+			return;
+		}
+	}
 
 	nfsnprintf( uvpath, sizeof(uvpath), "%s/.uidvalidity", gctx->path );
 #ifndef USE_DB
@@ -946,10 +2769,10 @@ maildir_select( store_t *gctx, int create,
 		}
 	  dbok:
 #if SEEK_SET != 0
-		lck.l_whence = SEEK_SET;
+		ctx->lck.l_whence = SEEK_SET;
 #endif
-		lck.l_type = F_WRLCK;
-		if (fcntl( ctx->uvfd, F_SETLKW, &lck )) {
+		ctx->lck.l_type = F_WRLCK;
+		if (fcntl( ctx->uvfd, F_SETLKW, &ctx->lck )) {
 			sys_error( "Maildir error: cannot lock %s", uvpath );
 			cb( DRV_BOX_BAD, aux );
 			return;
@@ -970,9 +2793,9 @@ maildir_select( store_t *gctx, int create,
 			cb( DRV_BOX_BAD, aux );
 			return;
 		}
-		key.data = (void *)"UIDVALIDITY";
-		key.size = 11;
-		if ((ret = ctx->db->get( ctx->db, 0, &key, &value, 0 ))) {
+		ctx->key.data = (void *)"UIDVALIDITY";
+		ctx->key.size = 11;
+		if ((ret = ctx->db->get( ctx->db, 0, &ctx->key, &ctx->value, 0 ))) {
 			if (ret != DB_NOTFOUND) {
 				ctx->db->err( ctx->db, ret, "Maildir error: db->get()" );
 				cb( DRV_BOX_BAD, aux );
@@ -983,8 +2806,8 @@ maildir_select( store_t *gctx, int create,
 				return;
 			}
 		} else {
-			ctx->gen.uidvalidity = ((int *)value.data)[0];
-			ctx->nuid = ((int *)value.data)[1];
+			ctx->gen.uidvalidity = ((int *)ctx->value.data)[0];
+			ctx->nuid = ((int *)ctx->value.data)[1];
 			ctx->uvok = 1;
 		}
 		cb( DRV_OK, aux );
@@ -1016,18 +2839,32 @@ maildir_load( store_t *gctx, int minuid, int maxuid, int newuid, int *excs, int
               void (*cb)( int sts, void *aux ), void *aux )
 {
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
-	message_t **msgapp;
-	msglist_t msglist;
-	int i;
 
 	ctx->minuid = minuid;
 	ctx->maxuid = maxuid;
 	ctx->newuid = newuid;
 	ctx->excs = nfrealloc( excs, nexcs * sizeof(int) );
 	ctx->nexcs = nexcs;
+	sort_ints( ctx->excs, nexcs );
+	ctx->load_cb = cb;
+	ctx->load_aux = aux;
+	maildir_load_p2( ctx );
+}
 
-	if (maildir_scan( ctx, &msglist ) != DRV_OK) {
-		cb( DRV_BOX_BAD, aux );
+static void
+maildir_load_p2( void *aux )
+{
+	maildir_store_t *ctx = (maildir_store_t *)aux;
+	message_t **msgapp;
+	msglist_t msglist;
+	int i, delay;
+
+	if (maildir_scan( ctx, &msglist, &delay ) != DRV_OK) {
+		ctx->load_cb( DRV_BOX_BAD, ctx->load_aux );
+		return;
+	}
+	if (delay) {
+		conf_wakeup( &ctx->scan_wakeup, delay );
 		return;
 	}
 	msgapp = &ctx->gen.msgs;
@@ -1035,7 +2872,7 @@ maildir_load( store_t *gctx, int minuid, int maxuid, int newuid, int *excs, int
 		maildir_app_msg( ctx, &msgapp, msglist.ents + i );
 	maildir_free_scan( &msglist );
 
-	cb( DRV_OK, aux );
+	ctx->load_cb( DRV_OK, ctx->load_aux );
 }
 
 static int
@@ -1046,7 +2883,7 @@ maildir_rescan( maildir_store_t *ctx )
 	msglist_t msglist;
 	int i;
 
-	if (maildir_scan( ctx, &msglist ) != DRV_OK)
+	if (maildir_scan( ctx, &msglist, 0 ) != DRV_OK)
 		return DRV_BOX_BAD;
 	ctx->gen.recent = 0;
 	for (msgapp = &ctx->gen.msgs, i = 0;
@@ -1093,60 +2930,160 @@ static int
 maildir_again( maildir_store_t *ctx, maildir_message_t *msg,
                const char *err, const char *fn, const char *fn2 )
 {
-	int ret;
+	int i, ret;
+	char buf[_POSIX_PATH_MAX];
 
 	if (errno != ENOENT) {
 		sys_error( err, fn, fn2 );
 		return DRV_BOX_BAD;
 	}
+	/* Most likely, somebody just changed the message's flags. */
+	if ((i = maildir_find_base( ctx->gen.path, msg->base, strcspn( msg->base, ":" ), buf, sizeof(buf) )) >= 0) {
+		debug( "message %d was renamed to %s\n", msg->gen.uid, buf );
+		free( msg->base );
+		msg->base = nfstrdup( buf );
+		msg->gen.status &= ~M_RECENT;
+		if (i)
+			msg->gen.status |= M_RECENT;
+		if (msg->gen.status & M_FLAGS)
+			msg->gen.flags = maildir_parse_flags( msg->base );
+		return DRV_OK;
+	}
 	if ((ret = maildir_rescan( ctx )) != DRV_OK)
 		return ret;
 	return (msg->gen.status & M_DEAD) ? DRV_MSG_BAD : DRV_OK;
 }
 
 static void
-maildir_fetch_msg( store_t *gctx, message_t *gmsg, msg_data_t *data,
+maildir_fetch_now( maildir_store_t *ctx, maildir_message_t *msg, msg_data_t *data,
                    void (*cb)( int sts, void *aux ), void *aux )
 {
-	maildir_store_t *ctx = (maildir_store_t *)gctx;
-	maildir_message_t *msg = (maildir_message_t *)gmsg;
 	int fd, ret;
 	struct stat st;
-	char buf[_POSIX_PATH_MAX];
 
 	for (;;) {
-		nfsnprintf( buf, sizeof(buf), "%s/%s/%s", gctx->path, subdirs[gmsg->status & M_RECENT], msg->base );
-		if ((fd = open( buf, O_RDONLY )) >= 0)
+		if ((fd = openat( ctx->dfds[msg->gen.status & M_RECENT], msg->base, O_RDONLY )) >= 0)
 			break;
-		if ((ret = maildir_again( ctx, msg, "Cannot open %s", buf, 0 )) != DRV_OK) {
+		if ((ret = maildir_again( ctx, msg, "Cannot open %s",
+		                          maildir_path( ctx, ctx->dfds[msg->gen.status & M_RECENT], msg->base ), 0 )) != DRV_OK) {
 			cb( ret, aux );
 			return;
 		}
 	}
-	fstat( fd, &st );
+	if (fstat( fd, &st )) {
+		sys_error( "Maildir error: cannot stat %s", maildir_path( ctx, ctx->dfds[msg->gen.status & M_RECENT], msg->base ) );
+		close( fd );
+		cb( DRV_MSG_BAD, aux );
+		return;
+	}
 	data->len = st.st_size;
 	if (data->date == -1)
 		data->date = st.st_mtime;
 	data->data = nfmalloc( data->len );
 	if (read( fd, data->data, data->len ) != data->len) {
-		sys_error( "Maildir error: cannot read %s", buf );
+		sys_error( "Maildir error: cannot read %s", maildir_path( ctx, ctx->dfds[msg->gen.status & M_RECENT], msg->base ) );
+		free( data->data );
 		close( fd );
 		cb( DRV_MSG_BAD, aux );
 		return;
 	}
 	close( fd );
-	if (!(gmsg->status & M_FLAGS))
+	if (!(msg->gen.status & M_FLAGS))
 		data->flags = maildir_parse_flags( msg->base );
 	cb( DRV_OK, aux );
 }
 
-static int
-maildir_make_flags( int flags, char *buf )
+#ifdef USE_WORKERS
+typedef struct {
+	maildir_message_t *msg;
+	msg_data_t *data;
+	void (*cb)( int sts, void *aux );
+	void *aux;
+	int dfd;
+	msg_data_t rd; /* what the worker read */
+} maildir_fetch_job_t;
+
+static void
+maildir_fetch_work( maildir_uop_t *op )
 {
-	unsigned i, d;
+	maildir_fetch_job_t *job = (maildir_fetch_job_t *)op->aux;
+	struct stat st;
+	int fd, n;
 
-	buf[0] = ':';
-	buf[1] = '2';
+	if ((fd = openat( job->dfd, op->name, O_RDONLY )) < 0) {
+		op->res = errno;
+		return;
+	}
+	if (fstat( fd, &st )) {
+		op->res = errno;
+		close( fd );
+		return;
+	}
+	job->rd.len = st.st_size;
+	job->rd.date = st.st_mtime;
+	/* Not nfmalloc(), which would bail out from this thread. */
+	if (!(job->rd.data = malloc( job->rd.len + 1 ))) {
+		op->res = ENOMEM;
+	} else if ((n = read( fd, job->rd.data, job->rd.len )) != job->rd.len) {
+		op->res = n < 0 ? errno : EIO;
+		free( job->rd.data );
+	}
+	close( fd );
+}
+
+static void
+maildir_fetch_done( maildir_uop_t *op )
+{
+	maildir_fetch_job_t *job = (maildir_fetch_job_t *)op->aux;
+
+	if (!op->ctx) {
+		if (!op->res)
+			free( job->rd.data );
+	} else if (op->res) {
+		/* The synchronous path deals with renamed messages and reports errors. */
+		maildir_fetch_now( op->ctx, job->msg, job->data, job->cb, job->aux );
+	} else {
+		job->data->data = job->rd.data;
+		job->data->len = job->rd.len;
+		if (job->data->date == -1)
+			job->data->date = job->rd.date;
+		if (!(job->msg->gen.status & M_FLAGS))
+			job->data->flags = maildir_parse_flags( job->msg->base );
+		job->cb( DRV_OK, job->aux );
+	}
+	free( job );
+}
+#endif /* USE_WORKERS */
+
+static void
+maildir_fetch_msg( store_t *gctx, message_t *gmsg, msg_data_t *data,
+                   void (*cb)( int sts, void *aux ), void *aux )
+{
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_message_t *msg = (maildir_message_t *)gmsg;
+#ifdef USE_WORKERS
+	maildir_fetch_job_t *job;
+
+	job = nfmalloc( sizeof(*job) );
+	job->msg = msg;
+	job->data = data;
+	job->cb = cb;
+	job->aux = aux;
+	job->dfd = ctx->dfds[gmsg->status & M_RECENT];
+	if (maildir_work( ctx, msg->base, 0, maildir_fetch_work, maildir_fetch_done, job ))
+		return;
+	free( job );
+#endif /* USE_WORKERS */
+	maildir_fetch_now( ctx, msg, data, cb, aux );
+}
+
+static int
+maildir_make_flags( int flags, char *buf )
+{
+	unsigned i, d;
+
+	buf[0] = ':';
+	buf[1] = '2';
 	buf[2] = ',';
 	for (d = 3, i = 0; i < as(Flags); i++)
 		if (flags & (1 << i))
@@ -1155,99 +3092,629 @@ maildir_make_flags( int flags, char *buf )
 	return d;
 }
 
-static void
-maildir_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
-                   void (*cb)( int sts, int uid, void *aux ), void *aux )
+/* The size is encoded like Dovecot does, so scanning needs no stat(). */
+static int
+maildir_make_base( maildir_store_t *ctx, int to_trash, int size, const char *tuid, char *base, int *uid )
 {
-	maildir_store_t *ctx = (maildir_store_t *)gctx;
-	const char *box;
-	int ret, fd, bl, uid;
-	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX], fbuf[NUM_FLAGS + 3], base[128];
+	int ret, bl;
 
-	bl = nfsnprintf( base, sizeof(base), "%ld.%d_%d.%s", (long)time( 0 ), Pid, ++MaildirCount, Hostname );
+	bl = nfsnprintf( base, 128, "%ld.%d_%d.%s,S=%d", (long)time( 0 ), Pid, maildir_next_count(), Hostname, size );
+	*uid = 0;
 	if (!to_trash) {
 #ifdef USE_DB
 		if (ctx->db) {
-			if ((ret = maildir_set_uid( ctx, base, &uid )) != DRV_OK) {
-				free( data->data );
-				cb( ret, 0, aux );
-				return;
-			}
-		} else
+			/* Synced only along with the message; see maildir_commit_uids(). */
+			ctx->uids_dirty = 1;
+			return maildir_put_uid( ctx, base, uid, tuid );
+		}
 #endif /* USE_DB */
-		{
-			if ((ret = maildir_uidval_lock( ctx )) != DRV_OK ||
-			    (ret = maildir_obtain_uid( ctx, &uid )) != DRV_OK) {
-				free( data->data );
-				cb( ret, 0, aux );
-				return;
-			}
+		if (!ctx->nrsvuids) {
+			/* Reserve more UIDs each time, as we are probably storing many messages. */
+			ctx->uidbatch = ctx->uidbatch ? ctx->uidbatch < MAX_UID_BATCH ? ctx->uidbatch * 2 : MAX_UID_BATCH : 1;
+			if ((ret = maildir_uidval_lock( ctx )) != DRV_OK)
+				return ret;
+			ret = maildir_reserve_uids( ctx, ctx->uidbatch );
 			maildir_uidval_unlock( ctx );
-			nfsnprintf( base + bl, sizeof(base) - bl, ",U=%d", uid );
+			if (ret != DRV_OK)
+				return ret;
+		}
+		maildir_obtain_uid( ctx, uid );
+		nfsnprintf( base + bl, 128 - bl, ",U=%d", *uid );
+	}
+	return DRV_OK;
+}
+
+/* The UID map entries of stored messages must be on disk before their
+ * UIDs are reported. A whole batch of messages needs just one db->sync(). */
+static int
+maildir_commit_uids( maildir_store_t *ctx )
+{
+#ifdef USE_DB
+	if (ctx->uids_dirty)
+		return maildir_sync_uids( ctx );
+#else
+	(void)ctx;
+#endif /* USE_DB */
+	return DRV_OK;
+}
+
+/* Stored messages are synced to disk in batches, and only then moved into
+ * place and acknowledged. The batch is flushed once the current round of
+ * events is processed, or when it becomes too big. */
+#define MAX_PENDING 128
+#define SYNCFS_MIN 32 /* smaller batches are fsync()ed file by file */
+
+#ifdef USE_URING
+static void
+maildir_stored_done( maildir_uop_t *op )
+{
+	maildir_pending_t *pend = (maildir_pending_t *)op->aux;
+
+	if (op->ctx) {
+		if (op->res < 0) {
+			errno = -op->res;
+			sys_error( "Maildir error: cannot rename %s to %s",
+			           maildir_path( op->ctx, pend->tdfd, pend->tmpname ), maildir_path( op->ctx, pend->ddfd, pend->name ) );
+			pend->cb( DRV_BOX_BAD, 0, pend->aux );
+		} else {
+			maildir_note_stored( op->ctx, pend->ddfd, pend->name, pend->uid, pend->tuid );
+#ifdef USE_DB
+			if (pend->msgid)
+				maildir_set_msgid( op->ctx, pend->msgid, maildir_path( op->ctx, pend->ddfd, pend->name ) );
+#endif /* USE_DB */
+			pend->cb( DRV_OK, pend->uid, pend->aux );
 		}
-		box = gctx->path;
+	}
+	maildir_free_pending( pend );
+}
+#endif /* USE_URING */
+
+/* Make the stored messages durable. This may run in a worker thread. */
+static void
+maildir_sync_stored( maildir_pending_t *list )
+{
+	maildir_pending_t *pend;
+	int synced = 0;
+#ifdef HAVE_SYNCFS
+	int n;
+
+	/* One call for the whole file system is cheaper than many fsync()s,
+	 * but it also flushes everybody else's dirty data, so it pays off
+	 * only for big batches. */
+	for (n = 0, pend = list; pend && n < SYNCFS_MIN; pend = pend->next)
+		n++;
+	if (n >= SYNCFS_MIN)
+		synced = !syncfs( list->fd );
+#endif
+	for (pend = list; pend; pend = pend->next) {
+		pend->err = 0;
+		if (!synced && fsync( pend->fd ))
+			pend->err = errno;
+		if (close( pend->fd ) < 0 && !pend->err)
+			/* Quota exceeded may cause this. */
+			pend->err = errno;
+	}
+}
+
+static void
+maildir_move_stored( maildir_store_t *ctx, maildir_pending_t *list )
+{
+	maildir_pending_t *pend, *next, **pendp;
+	unsigned guard;
+	int bad;
+
+	bad = maildir_commit_uids( ctx ) != DRV_OK;
+	for (pendp = &list; (pend = *pendp); ) {
+		if (pend->err) {
+			errno = pend->err;
+			sys_error( "Maildir error: cannot write %s", maildir_path( ctx, pend->tdfd, pend->tmpname ) );
+			pend->uid = -1;
+		} else if (bad) {
+			unlinkat( pend->tdfd, pend->tmpname, 0 );
+			pend->uid = -1;
+		}
+#ifdef USE_URING
+		else if (maildir_uring_rename( ctx, pend->tdfd, pend->tmpname, pend->ddfd, pend->name,
+		                               maildir_stored_done, pend )) {
+			/* This one is reported when the rename completes. */
+			*pendp = pend->next;
+			continue;
+		}
+#endif /* USE_URING */
+		else if (renameat( pend->tdfd, pend->tmpname, pend->ddfd, pend->name )) {
+			sys_error( "Maildir error: cannot rename %s to %s",
+			           maildir_path( ctx, pend->tdfd, pend->tmpname ), maildir_path( ctx, pend->ddfd, pend->name ) );
+			pend->uid = -1;
+		} else {
+			maildir_note_stored( ctx, pend->ddfd, pend->name, pend->uid, pend->tuid );
+#ifdef USE_DB
+			if (pend->msgid)
+				maildir_set_msgid( ctx, pend->msgid, maildir_path( ctx, pend->ddfd, pend->name ) );
+#endif /* USE_DB */
+		}
+		pendp = &pend->next;
+	}
+	/* The callbacks may cancel the store, after which nothing is reported anymore. */
+	guard = maildir_guard_enter( ctx );
+	for (pend = list; pend; pend = next) {
+		next = pend->next;
+		if (!maildir_guard_dead( ctx, guard )) {
+			if (pend->uid < 0)
+				pend->cb( DRV_BOX_BAD, 0, pend->aux );
+			else
+				pend->cb( DRV_OK, pend->uid, pend->aux );
+		}
+		maildir_free_pending( pend );
+	}
+	maildir_guard_leave( ctx, guard );
+}
+
+#ifdef USE_WORKERS
+static void
+maildir_sync_work( maildir_uop_t *op )
+{
+	maildir_sync_stored( (maildir_pending_t *)op->aux );
+}
+
+static void
+maildir_synced( maildir_uop_t *op )
+{
+	maildir_pending_t *pend, *next;
+
+	if (op->ctx) {
+		maildir_move_stored( op->ctx, (maildir_pending_t *)op->aux );
+		return;
+	}
+	/* Dropped like the messages still waiting for a flush. */
+	for (pend = (maildir_pending_t *)op->aux; pend; pend = next) {
+		next = pend->next;
+		unlinkat( pend->tdfd, pend->tmpname, 0 );
+		maildir_free_pending( pend );
+	}
+}
+#endif /* USE_WORKERS */
+
+static void
+maildir_flush_stored( void *aux )
+{
+	maildir_store_t *ctx = (maildir_store_t *)aux;
+	maildir_pending_t *list;
+
+	list = ctx->pending;
+	ctx->pending = 0;
+	ctx->pending_append = &ctx->pending;
+	ctx->npending = 0;
+	conf_wakeup( &ctx->flush_wakeup, -1 );
+	maildir_save_stored( ctx );
+	if (!list)
+		return;
+#ifdef USE_WORKERS
+	if (maildir_work( ctx, 0, 0, maildir_sync_work, maildir_synced, list ))
+		return;
+#endif /* USE_WORKERS */
+	maildir_sync_stored( list );
+	maildir_move_stored( ctx, list );
+}
+
+static void
+maildir_queue_stored( maildir_store_t *ctx, int fd, int tdfd, const char *tmpname, int ddfd, const char *name,
+                      const char *msgid, int uid, const char *tuid,
+                      void (*cb)( int sts, int uid, void *aux ), void *aux )
+{
+	maildir_pending_t *pend = nfmalloc( sizeof(*pend) );
+
+	pend->next = 0;
+	pend->tmpname = nfstrdup( tmpname );
+	pend->name = nfstrdup( name );
+	pend->msgid = msgid ? nfstrdup( msgid ) : 0;
+	pend->fd = fd;
+	pend->tdfd = tdfd;
+	pend->ddfd = ddfd;
+	pend->uid = uid;
+	memcpy( pend->tuid, tuid, TUIDL );
+	pend->cb = cb;
+	pend->aux = aux;
+	*ctx->pending_append = pend;
+	ctx->pending_append = &pend->next;
+	if (++ctx->npending >= MAX_PENDING)
+		maildir_flush_stored( ctx );
+	else if (ctx->npending == 1)
+		conf_wakeup( &ctx->flush_wakeup, 0 );
+}
+
+/* New messages for the selected box are created relative to its
+ * directories. The trash is addressed by full paths. */
+static void
+maildir_make_names( maildir_store_t *ctx, int to_trash, int flags, const char *base,
+                    int *tdfd, char *tmpname, int *ddfd, char *name )
+{
+	char fbuf[NUM_FLAGS + 3];
+
+	maildir_make_flags( flags, fbuf );
+	/* Moving seen messages to cur/ is strictly speaking incorrect, but makes mutt happy. */
+	if (to_trash) {
+		*tdfd = *ddfd = AT_FDCWD;
+		nfsnprintf( tmpname, _POSIX_PATH_MAX, "%s/tmp/%s%s", ctx->trash, base, fbuf );
+		nfsnprintf( name, _POSIX_PATH_MAX, "%s/%s/%s%s", ctx->trash, subdirs[!(flags & F_SEEN)], base, fbuf );
 	} else {
-		box = ctx->trash;
+		*tdfd = ctx->dfds[2];
+		*ddfd = ctx->dfds[!(flags & F_SEEN)];
+		nfsnprintf( tmpname, _POSIX_PATH_MAX, "%s%s", base, fbuf );
+		strcpy( name, tmpname );
 	}
+}
 
-	maildir_make_flags( data->flags, fbuf );
-	nfsnprintf( buf, sizeof(buf), "%s/tmp/%s%s", box, base, fbuf );
-	if ((fd = open( buf, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
+static int
+maildir_create_tmp( maildir_store_t *ctx, int to_trash, int dfd, const char *name, int *fdp )
+{
+	int ret;
+
+	if ((*fdp = openat( dfd, name, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
 		if (errno != ENOENT || !to_trash) {
-			sys_error( "Maildir error: cannot create %s", buf );
-			free( data->data );
-			cb( DRV_BOX_BAD, 0, aux );
-			return;
-		}
-		if ((ret = maildir_validate( box, 1, ctx )) != DRV_OK) {
-			free( data->data );
-			cb( ret, 0, aux );
-			return;
+			sys_error( "Maildir error: cannot create %s", maildir_path( ctx, dfd, name ) );
+			return DRV_BOX_BAD;
 		}
-		if ((fd = open( buf, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
-			sys_error( "Maildir error: cannot create %s", buf );
-			free( data->data );
-			cb( DRV_BOX_BAD, 0, aux );
-			return;
+		if ((ret = maildir_validate( ctx->trash, 1, ctx )) != DRV_OK)
+			return ret;
+		if ((*fdp = openat( dfd, name, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
+			sys_error( "Maildir error: cannot create %s", maildir_path( ctx, dfd, name ) );
+			return DRV_BOX_BAD;
 		}
 	}
-	ret = write( fd, data->data, data->len );
-	free( data->data );
-	if (ret != data->len || ((FSyncLevel >= FSYNC_NORMAL) && (ret = fsync( fd )))) {
-		if (ret < 0)
-			sys_error( "Maildir error: cannot write %s", buf );
-		else
-			error( "Maildir error: cannot write %s. Disk full?\n", buf );
-		close( fd );
-		cb( DRV_BOX_BAD, 0, aux );
+	return DRV_OK;
+}
+
+/* Move a completely written file from tmp/ into place, possibly after
+ * syncing it as part of a batch. */
+static void
+maildir_finish_store( maildir_store_t *ctx, int fd, int tdfd, const char *tmpname, int ddfd, const char *name,
+                      const char *msgid, int uid, const char *tuid,
+                      void (*cb)( int sts, int uid, void *aux ), void *aux )
+{
+	int ret;
+
+	if (FSyncLevel >= FSYNC_NORMAL) {
+		maildir_queue_stored( ctx, fd, tdfd, tmpname, ddfd, name, msgid, uid, tuid, cb, aux );
 		return;
 	}
 	if (close( fd ) < 0) {
 		/* Quota exceeded may cause this. */
-		sys_error( "Maildir error: cannot write %s", buf );
+		sys_error( "Maildir error: cannot write %s", maildir_path( ctx, tdfd, tmpname ) );
+		cb( DRV_BOX_BAD, 0, aux );
+		return;
+	}
+	if ((ret = maildir_commit_uids( ctx )) != DRV_OK) {
+		cb( ret, 0, aux );
+		return;
+	}
+	if (renameat( tdfd, tmpname, ddfd, name )) {
+		sys_error( "Maildir error: cannot rename %s to %s",
+		           maildir_path( ctx, tdfd, tmpname ), maildir_path( ctx, ddfd, name ) );
 		cb( DRV_BOX_BAD, 0, aux );
 		return;
 	}
+	maildir_note_stored( ctx, ddfd, name, uid, tuid );
+#ifdef USE_DB
+	if (msgid)
+		maildir_set_msgid( ctx, msgid, maildir_path( ctx, ddfd, name ) );
+#else
+	(void)msgid;
+#endif /* USE_DB */
+	cb( DRV_OK, uid, aux );
+}
+
+/* Copy the file contents without passing them through user space, where
+ * the system allows that. */
+static int
+maildir_copy_file( int sfd, int dfd, off_t len )
+{
+	ssize_t n;
+	char buf[16384];
+
+#ifdef FICLONE
+	if (!ioctl( dfd, FICLONE, sfd ))
+		return 0;
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	/* This advances the file offsets, so a fallback just continues. */
+	while (len > 0 && (n = copy_file_range( sfd, 0, dfd, 0, len, 0 )) > 0)
+		len -= n;
+#endif
+	while (len > 0) {
+		if ((n = read( sfd, buf, len < (off_t)sizeof(buf) ? len : (off_t)sizeof(buf) )) <= 0 ||
+		    write( dfd, buf, n ) != n)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
 
-	if (data->date) {
+/* Writing a stored message, or the copy of one, may run in a worker thread. */
+typedef struct {
+	msg_data_t data;
+	int sfd; /* the file to copy, or -1 to write the data */
+	int fd, tdfd, ddfd, uid, written;
+	char *msgid, *spath;
+	char tuid[TUIDL];
+	void (*cb)( int sts, int uid, void *aux );
+	void *aux;
+} maildir_write_job_t;
+
+static int
+maildir_write_job( maildir_write_job_t *job )
+{
+	struct timespec times[2];
+
+	if (job->sfd >= 0) {
+		if ((job->written = maildir_copy_file( job->sfd, job->fd, job->data.len ) ? -1 : job->data.len) < 0)
+			return errno;
+	} else if ((job->written = write( job->fd, job->data.data, job->data.len )) != job->data.len) {
+		return job->written < 0 ? errno : 0;
+	}
+	if (job->data.date) {
 		/* Set atime and mtime according to INTERNALDATE or mtime of source message */
-		struct utimbuf utimebuf;
-		utimebuf.actime = utimebuf.modtime = data->date;
-		if (utime( buf, &utimebuf ) < 0) {
-			sys_error( "Maildir error: cannot set times for %s", buf );
-			cb( DRV_BOX_BAD, 0, aux );
+		times[0].tv_sec = times[1].tv_sec = job->data.date;
+		times[0].tv_nsec = times[1].tv_nsec = 0;
+		if (futimens( job->fd, times ) < 0)
+			return errno;
+	}
+	return 0;
+}
+
+static void
+maildir_free_write_job( maildir_write_job_t *job )
+{
+	if (job->sfd >= 0)
+		close( job->sfd );
+	else
+		free( job->data.data );
+	free( job->msgid );
+	free( job->spath );
+	free( job );
+}
+
+static void
+maildir_written( maildir_store_t *ctx, maildir_write_job_t *job, int err, const char *tmpname, const char *name )
+{
+	errno = err;
+	if (job->written != job->data.len) {
+		if (job->sfd >= 0)
+			sys_error( "Maildir error: cannot copy %s to %s", job->spath, maildir_path( ctx, job->tdfd, tmpname ) );
+		else if (job->written < 0)
+			sys_error( "Maildir error: cannot write %s", maildir_path( ctx, job->tdfd, tmpname ) );
+		else
+			error( "Maildir error: cannot write %s. Disk full?\n", maildir_path( ctx, job->tdfd, tmpname ) );
+		close( job->fd );
+		job->cb( DRV_BOX_BAD, 0, job->aux );
+	} else if (err) {
+		sys_error( "Maildir error: cannot set times for %s", maildir_path( ctx, job->tdfd, tmpname ) );
+		close( job->fd );
+		job->cb( DRV_BOX_BAD, 0, job->aux );
+	} else {
+		maildir_finish_store( ctx, job->fd, job->tdfd, tmpname, job->ddfd, name, job->msgid, job->uid, job->tuid,
+		                      job->cb, job->aux );
+	}
+	maildir_free_write_job( job );
+}
+
+#ifdef USE_WORKERS
+static void
+maildir_write_work( maildir_uop_t *op )
+{
+	op->res = maildir_write_job( (maildir_write_job_t *)op->aux );
+}
+
+static void
+maildir_write_done( maildir_uop_t *op )
+{
+	maildir_write_job_t *job = (maildir_write_job_t *)op->aux;
+
+	if (op->ctx) {
+		maildir_written( op->ctx, job, op->res, op->name, op->name2 );
+		return;
+	}
+	close( job->fd );
+	unlinkat( job->tdfd, op->name, 0 );
+	maildir_free_write_job( job );
+}
+#endif /* USE_WORKERS */
+
+static void
+maildir_write( maildir_store_t *ctx, maildir_write_job_t *job, const char *tmpname, const char *name )
+{
+#ifdef USE_WORKERS
+	if (maildir_work( ctx, tmpname, name, maildir_write_work, maildir_write_done, job ))
+		return;
+#endif /* USE_WORKERS */
+	maildir_written( ctx, job, maildir_write_job( job ), tmpname, name );
+}
+
+/* The message ID map serves only copies which can be found again (see
+ * maildir_link_msg()), so it is not maintained for stores without any. */
+static int
+maildir_msgid_map_used( maildir_store_t *ctx )
+{
+#ifdef USE_DB
+	return ctx->gen.conf->trash || ((maildir_store_conf_t *)ctx->gen.conf)->alt_map || ctx->db;
+#else
+	(void)ctx;
+	return 0;
+#endif /* USE_DB */
+}
+
+static void
+maildir_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
+                   void (*cb)( int sts, int uid, void *aux ), void *aux )
+{
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_write_job_t *job;
+	int ret, fd, uid, tdfd, ddfd;
+	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX], base[128];
+
+	if ((ret = maildir_make_base( ctx, to_trash, data->len, data->tuid, base, &uid )) != DRV_OK) {
+		free( data->data );
+		cb( ret, 0, aux );
+		return;
+	}
+	maildir_make_names( ctx, to_trash, data->flags, base, &tdfd, buf, &ddfd, nbuf );
+	if ((ret = maildir_create_tmp( ctx, to_trash, tdfd, buf, &fd )) != DRV_OK) {
+		free( data->data );
+		cb( ret, 0, aux );
+		return;
+	}
+	job = nfmalloc( sizeof(*job) );
+	job->data = *data;
+	job->sfd = -1;
+	job->fd = fd;
+	job->tdfd = tdfd;
+	job->ddfd = ddfd;
+	job->uid = uid;
+	job->msgid = (data->msgid && !to_trash && maildir_msgid_map_used( ctx )) ? nfstrdup( data->msgid ) : 0;
+	if (data->tuid)
+		memcpy( job->tuid, data->tuid, TUIDL );
+	else
+		job->tuid[0] = 0;
+	job->spath = 0;
+	job->cb = cb;
+	job->aux = aux;
+	maildir_write( ctx, job, buf, nbuf );
+}
+
+/* Make a copy of a message file which is already open as sfd, either
+ * as a hard link, or by copying its contents. spath names the file in
+ * messages. With a date of -1, a copy gets the file's modification time
+ * as its arrival date; a hard link shares it anyway.
+ * Maildir files are never modified, so they can be shared. But some
+ * MUAs and backup tools do not expect that, so this is opt-in; the copy
+ * shares the data blocks anyway where the file system can. */
+static void
+maildir_clone_msg( maildir_store_t *ctx, int sdfd, const char *sname, const char *spath, int sfd, const struct stat *st,
+                   int to_trash, int flags, const char *tuid, int date,
+                   void (*cb)( int sts, int uid, void *aux ), void *aux )
+{
+	maildir_write_job_t *job;
+	int fd, ret, uid, tdfd, ddfd;
+	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX], base[128];
+
+	if ((ret = maildir_make_base( ctx, to_trash, st->st_size, tuid, base, &uid )) != DRV_OK) {
+		close( sfd );
+		cb( ret, 0, aux );
+		return;
+	}
+	maildir_make_names( ctx, to_trash, flags, base, &tdfd, buf, &ddfd, nbuf );
+
+	if (((maildir_store_conf_t *)ctx->gen.conf)->hard_links &&
+	    (!linkat( sdfd, sname, ddfd, nbuf, 0 ) ||
+	     (errno == ENOENT && to_trash && maildir_validate( ctx->trash, 1, ctx ) == DRV_OK &&
+	      !linkat( sdfd, sname, ddfd, nbuf, 0 )))) {
+		close( sfd );
+		/* A link is complete right away, so it is not part of any batch. */
+		if ((ret = maildir_commit_uids( ctx )) != DRV_OK) {
+			cb( ret, 0, aux );
 			return;
 		}
+		if (tuid)
+			maildir_note_stored( ctx, ddfd, nbuf, uid, tuid );
+		cb( DRV_OK, uid, aux );
+		return;
 	}
 
-	/* Moving seen messages to cur/ is strictly speaking incorrect, but makes mutt happy. */
-	nfsnprintf( nbuf, sizeof(nbuf), "%s/%s/%s%s", box, subdirs[!(data->flags & F_SEEN)], base, fbuf );
-	if (rename( buf, nbuf )) {
-		sys_error( "Maildir error: cannot rename %s to %s", buf, nbuf );
-		cb( DRV_BOX_BAD, 0, aux );
+	if ((ret = maildir_create_tmp( ctx, to_trash, tdfd, buf, &fd )) != DRV_OK) {
+		close( sfd );
+		cb( ret, 0, aux );
 		return;
 	}
-	cb( DRV_OK, uid, aux );
+	job = nfcalloc( sizeof(*job) );
+	job->data.len = st->st_size;
+	job->data.date = (date == -1) ? st->st_mtime : 0;
+	job->sfd = sfd;
+	job->fd = fd;
+	job->tdfd = tdfd;
+	job->ddfd = ddfd;
+	job->uid = uid;
+	if (tuid)
+		memcpy( job->tuid, tuid, TUIDL );
+	job->spath = nfstrdup( spath );
+	job->cb = cb;
+	job->aux = aux;
+	maildir_write( ctx, job, buf, nbuf );
+}
+
+static void
+maildir_link_msg( store_t *gctx, msg_data_t *data, int to_trash,
+                  void (*cb)( int sts, int uid, void *aux ), void *aux )
+{
+#ifdef USE_DB
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	int sfd;
+	struct stat st;
+	char buf[_POSIX_PATH_MAX];
+
+	/* The file contains the TUID of its first copy, so we rely on the
+	 * one recorded in the UID map. Without one, the copy could not be
+	 * found by its TUID. */
+	if ((!to_trash && !ctx->db) ||
+	    maildir_get_msgid( ctx, data->msgid, buf, sizeof(buf) ) < 0 ||
+	    (sfd = open( buf, O_RDONLY )) < 0) {
+		cb( DRV_MSG_BAD, 0, aux );
+		return;
+	}
+	if (fstat( sfd, &st )) {
+		close( sfd );
+		cb( DRV_MSG_BAD, 0, aux );
+		return;
+	}
+	maildir_clone_msg( ctx, AT_FDCWD, buf, buf, sfd, &st, to_trash, data->flags, data->tuid, data->date, cb, aux );
+#else
+	(void)gctx; (void)data; (void)to_trash;
+	cb( DRV_MSG_BAD, 0, aux );
+#endif /* USE_DB */
+}
+
+/* Maildir messages need no conversion, so a message going to another
+ * Maildir store can be copied as it is. But the copy keeps the source's
+ * TUID (if any), so the right one can be recorded only in a UID map. */
+static int
+maildir_can_copy( store_t *gctx ATTR_UNUSED, store_t *dst, int tuid )
+{
+#ifdef USE_DB
+	if (((maildir_store_t *)dst)->db)
+		return 1;
+#else
+	(void)dst;
+#endif /* USE_DB */
+	return !tuid;
+}
+
+static void
+maildir_copy_msg( store_t *gctx, message_t *gmsg, store_t *gdst, const char *tuid, int to_trash, int date,
+                  void (*cb)( int sts, int uid, void *aux ), void *aux )
+{
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_message_t *msg = (maildir_message_t *)gmsg;
+	int sfd, ret, sdfd = ctx->dfds[gmsg->status & M_RECENT];
+	struct stat st;
+	char spath[_POSIX_PATH_MAX];
+
+	for (;;) {
+		if ((sfd = openat( sdfd, msg->base, O_RDONLY )) >= 0)
+			break;
+		if ((ret = maildir_again( ctx, msg, "Cannot open %s", maildir_path( ctx, sdfd, msg->base ), 0 )) != DRV_OK) {
+			cb( ret, 0, aux );
+			return;
+		}
+		sdfd = ctx->dfds[gmsg->status & M_RECENT];
+	}
+	strcpy( spath, maildir_path( ctx, sdfd, msg->base ) );
+	if (fstat( sfd, &st )) {
+		sys_error( "Maildir error: cannot stat %s", spath );
+		close( sfd );
+		cb( DRV_MSG_BAD, 0, aux );
+		return;
+	}
+	maildir_clone_msg( (maildir_store_t *)gdst, sdfd, msg->base, spath, sfd, &st, to_trash,
+	                   (gmsg->status & M_FLAGS) ? gmsg->flags : maildir_parse_flags( msg->base ),
+	                   tuid, date, cb, aux );
 }
 
 static void
@@ -1257,72 +3724,156 @@ maildir_find_new_msgs( store_t *gctx ATTR_UNUSED,
 	assert( !"maildir_find_new_msgs is not supposed to be called" );
 }
 
+/* Make the new name of a message with changed flags. */
 static void
-maildir_set_flags( store_t *gctx, message_t *gmsg, int uid ATTR_UNUSED, int add, int del,
-                   void (*cb)( int sts, void *aux ), void *aux )
+maildir_flags_name( maildir_message_t *msg, int add, int del, char *nbuf )
 {
-	maildir_store_t *ctx = (maildir_store_t *)gctx;
-	maildir_message_t *msg = (maildir_message_t *)gmsg;
 	char *s, *p;
 	unsigned i;
-	int j, ret, ol, fl, bbl, bl, tl;
-	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
+	int j, ol, fl;
 
-	bbl = nfsnprintf( buf, sizeof(buf), "%s/", gctx->path );
-	memcpy( nbuf, gctx->path, bbl - 1 );
-	memcpy( nbuf + bbl - 1, "/cur/", 5 );
-	for (;;) {
-		bl = bbl + nfsnprintf( buf + bbl, sizeof(buf) - bbl, "%s/", subdirs[gmsg->status & M_RECENT] );
-		ol = strlen( msg->base );
-		if ((int)sizeof(buf) - bl < ol + 3 + NUM_FLAGS)
-			oob();
-		memcpy( buf + bl, msg->base, ol + 1 );
-		memcpy( nbuf + bl, msg->base, ol + 1 );
-		if ((s = strstr( nbuf + bl, ":2," ))) {
-			s += 3;
-			fl = ol - (s - (nbuf + bl));
-			for (i = 0; i < as(Flags); i++) {
-				if ((p = strchr( s, Flags[i] ))) {
-					if (del & (1 << i)) {
-						memcpy( p, p + 1, fl - (p - s) );
-						fl--;
-					}
-				} else if (add & (1 << i)) {
-					for (j = 0; j < fl && Flags[i] > s[j]; j++);
-					fl++;
-					memmove( s + j + 1, s + j, fl - j );
-					s[j] = Flags[i];
+	ol = strlen( msg->base );
+	if (_POSIX_PATH_MAX < ol + 3 + NUM_FLAGS + 1)
+		oob();
+	memcpy( nbuf, msg->base, ol + 1 );
+	if ((s = strstr( nbuf, ":2," ))) {
+		s += 3;
+		fl = ol - (s - nbuf);
+		for (i = 0; i < as(Flags); i++) {
+			if ((p = strchr( s, Flags[i] ))) {
+				if (del & (1 << i)) {
+					memcpy( p, p + 1, fl - (p - s) );
+					fl--;
 				}
+			} else if (add & (1 << i)) {
+				for (j = 0; j < fl && Flags[i] > s[j]; j++);
+				fl++;
+				memmove( s + j + 1, s + j, fl - j );
+				s[j] = Flags[i];
 			}
-			tl = ol + 3 + fl;
-		} else {
-			tl = ol + maildir_make_flags( msg->gen.flags, nbuf + bl + ol );
-		}
-		if (!rename( buf, nbuf ))
-			break;
-		if ((ret = maildir_again( ctx, msg, "Maildir error: cannot rename %s to %s", buf, nbuf )) != DRV_OK) {
-			cb( ret, aux );
-			return;
 		}
+	} else {
+		maildir_make_flags( msg->gen.flags, nbuf + ol );
 	}
+}
+
+static void
+maildir_flags_renamed( maildir_message_t *msg, const char *nbuf, int add, int del )
+{
 	free( msg->base );
-	msg->base = nfmalloc( tl + 1 );
-	memcpy( msg->base, nbuf + bl, tl + 1 );
+	msg->base = nfstrdup( nbuf );
 	msg->gen.flags |= add;
 	msg->gen.flags &= ~del;
-	gmsg->status &= ~M_RECENT;
+	msg->gen.status &= ~M_RECENT;
+}
+
+static void
+maildir_set_flags_now( maildir_store_t *ctx, maildir_message_t *msg, int add, int del,
+                       void (*cb)( int sts, void *aux ), void *aux )
+{
+	int ret, sdfd;
+	char nbuf[_POSIX_PATH_MAX];
 
+	for (;;) {
+		sdfd = ctx->dfds[msg->gen.status & M_RECENT];
+		maildir_flags_name( msg, add, del, nbuf );
+		if (!renameat( sdfd, msg->base, ctx->dfds[0], nbuf ))
+			break;
+		if ((ret = maildir_again( ctx, msg, "Maildir error: cannot rename %s to %s",
+		                          maildir_path( ctx, sdfd, msg->base ), maildir_path( ctx, ctx->dfds[0], nbuf ) )) != DRV_OK) {
+			cb( ret, aux );
+			return;
+		}
+	}
+	maildir_flags_renamed( msg, nbuf, add, del );
 	cb( DRV_OK, aux );
 }
 
+/* Renames which failed are retried when the whole batch is done. As they
+ * most likely failed because the messages were renamed by somebody else,
+ * a single rescan is cheaper than looking up each of them. */
+static void
+maildir_retry_flags( maildir_store_t *ctx )
+{
+	maildir_flags_op_t *list, *fop;
+	unsigned guard;
+	int ret = DRV_OK;
+
+	if (!(list = ctx->flag_retries))
+		return;
+	ctx->flag_retries = 0;
+	if (list->next)
+		ret = maildir_rescan( ctx );
+	guard = maildir_guard_enter( ctx );
+	for (fop = list; fop && !maildir_guard_dead( ctx, guard ); fop = fop->next) {
+		if (ret != DRV_OK)
+			fop->cb( ret, fop->aux );
+		else if (fop->msg->gen.status & M_DEAD)
+			fop->cb( DRV_MSG_BAD, fop->aux );
+		else
+			maildir_set_flags_now( ctx, fop->msg, fop->add, fop->del, fop->cb, fop->aux );
+	}
+	maildir_free_flag_ops( list );
+	maildir_guard_leave( ctx, guard );
+}
+
+#ifdef USE_URING
+static void
+maildir_flags_done( maildir_uop_t *op )
+{
+	maildir_flags_op_t *fop = (maildir_flags_op_t *)op->aux;
+	maildir_store_t *ctx = op->ctx;
+	unsigned guard;
+
+	if (!ctx) {
+		free( fop );
+		return;
+	}
+	if (op->res < 0) {
+		fop->next = ctx->flag_retries;
+		ctx->flag_retries = fop;
+	} else {
+		/* The callback may cancel the store. */
+		guard = maildir_guard_enter( ctx );
+		maildir_flags_renamed( fop->msg, op->name2, fop->add, fop->del );
+		fop->cb( DRV_OK, fop->aux );
+		free( fop );
+		if (!maildir_guard_leave( ctx, guard ))
+			return;
+	}
+	if (!--ctx->flags_left)
+		maildir_retry_flags( ctx );
+}
+#endif /* USE_URING */
+
+/* Flag changes are queued until commit(), as the interface permits. */
+static void
+maildir_set_flags( store_t *gctx, message_t *gmsg, int uid ATTR_UNUSED, int add, int del,
+                   void (*cb)( int sts, void *aux ), void *aux )
+{
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_flags_op_t *fop;
+
+	fop = nfmalloc( sizeof(*fop) );
+	fop->next = 0;
+	fop->msg = (maildir_message_t *)gmsg;
+	fop->add = add;
+	fop->del = del;
+	fop->cb = cb;
+	fop->aux = aux;
+	*ctx->flag_ops_append = fop;
+	ctx->flag_ops_append = &fop->next;
+	ctx->nflag_ops++;
+}
+
 #ifdef USE_DB
 static int
 maildir_purge_msg( maildir_store_t *ctx, const char *name )
 {
 	int ret;
 
-	make_key( &key, (char *)name );
-	if ((ret = ctx->db->del( ctx->db, 0, &key, 0 ))) {
+	make_key( &ctx->key, (char *)name );
+	if ((ret = ctx->db->del( ctx->db, 0, &ctx->key, 0 ))) {
 		ctx->db->err( ctx->db, ret, "Maildir error: db->del()" );
 		return DRV_BOX_BAD;
 	}
@@ -1337,31 +3888,32 @@ maildir_trash_msg( store_t *gctx, message_t *gmsg,
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
 	maildir_message_t *msg = (maildir_message_t *)gmsg;
 	char *s;
-	int ret;
+	int ret, sdfd;
 	struct stat st;
-	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
+	char nbuf[_POSIX_PATH_MAX];
 
 	for (;;) {
-		nfsnprintf( buf, sizeof(buf), "%s/%s/%s", gctx->path, subdirs[gmsg->status & M_RECENT], msg->base );
+		sdfd = ctx->dfds[gmsg->status & M_RECENT];
 		s = strstr( msg->base, ":2," );
 		nfsnprintf( nbuf, sizeof(nbuf), "%s/%s/%ld.%d_%d.%s%s", ctx->trash,
-		            subdirs[gmsg->status & M_RECENT], (long)time( 0 ), Pid, ++MaildirCount, Hostname, s ? s : "" );
-		if (!rename( buf, nbuf ))
+		            subdirs[gmsg->status & M_RECENT], (long)time( 0 ), Pid, maildir_next_count(), Hostname, s ? s : "" );
+		if (!renameat( sdfd, msg->base, AT_FDCWD, nbuf ))
 			break;
-		if (!stat( buf, &st )) {
+		if (!fstatat( sdfd, msg->base, &st, 0 )) {
 			if ((ret = maildir_validate( ctx->trash, 1, ctx )) != DRV_OK) {
 				cb( ret, aux );
 				return;
 			}
-			if (!rename( buf, nbuf ))
+			if (!renameat( sdfd, msg->base, AT_FDCWD, nbuf ))
 				break;
 			if (errno != ENOENT) {
-				sys_error( "Maildir error: cannot move %s to %s", buf, nbuf );
+				sys_error( "Maildir error: cannot move %s to %s", maildir_path( ctx, sdfd, msg->base ), nbuf );
 				cb( DRV_BOX_BAD, aux );
 				return;
 			}
 		}
-		if ((ret = maildir_again( ctx, msg, "Maildir error: cannot move %s to %s", buf, nbuf )) != DRV_OK) {
+		if ((ret = maildir_again( ctx, msg, "Maildir error: cannot move %s to %s",
+		                          maildir_path( ctx, sdfd, msg->base ), nbuf )) != DRV_OK) {
 			cb( ret, aux );
 			return;
 		}
@@ -1378,37 +3930,118 @@ maildir_trash_msg( store_t *gctx, message_t *gmsg,
 	cb( DRV_OK, aux );
 }
 
+/* Account for the removal of a deleted message. */
+static int
+maildir_unlinked( maildir_store_t *ctx, int dfd, message_t *msg, int err, int *retry )
+{
+	if (err) {
+		if (err == ENOENT) {
+			*retry = 1;
+		} else {
+			errno = err;
+			sys_error( "Maildir error: cannot remove %s", maildir_path( ctx, dfd, ((maildir_message_t *)msg)->base ) );
+		}
+		return DRV_OK;
+	}
+	msg->status |= M_DEAD;
+	ctx->gen.count--;
+#ifdef USE_DB
+	if (ctx->db)
+		return maildir_purge_msg( ctx, ((maildir_message_t *)msg)->base );
+#endif /* USE_DB */
+	return DRV_OK;
+}
+
+#ifdef USE_URING
+static void maildir_close_round( maildir_store_t *ctx );
+
+static void
+maildir_close_finish( maildir_store_t *ctx )
+{
+	int ret;
+
+	if (ctx->close_sts != DRV_OK) {
+		ctx->close_cb( ctx->close_sts, ctx->close_aux );
+		return;
+	}
+	if (!ctx->close_retry) {
+		ctx->close_cb( DRV_OK, ctx->close_aux );
+		return;
+	}
+	if ((ret = maildir_rescan( ctx )) != DRV_OK) {
+		ctx->close_cb( ret, ctx->close_aux );
+		return;
+	}
+	maildir_close_round( ctx );
+}
+
+static void
+maildir_unlink_done( maildir_uop_t *op )
+{
+	maildir_store_t *ctx = op->ctx;
+	message_t *msg = (message_t *)op->aux;
+	int ret;
+
+	if (!ctx)
+		return;
+	if ((ret = maildir_unlinked( ctx, ctx->dfds[msg->status & M_RECENT], msg, -op->res, &ctx->close_retry )) != DRV_OK &&
+	    ctx->close_sts == DRV_OK)
+		ctx->close_sts = ret;
+	if (!--ctx->close_left)
+		maildir_close_finish( ctx );
+}
+
+static void
+maildir_close_round( maildir_store_t *ctx )
+{
+	message_t *msg;
+	int ret, dfd;
+
+	ctx->close_left = 1;
+	ctx->close_retry = 0;
+	for (msg = ctx->gen.msgs; msg && ctx->close_sts == DRV_OK; msg = msg->next)
+		if (!(msg->status & M_DEAD) && (msg->flags & F_DELETED)) {
+			dfd = ctx->dfds[msg->status & M_RECENT];
+			ctx->close_left++;
+			if (maildir_uring_unlink( ctx, dfd, ((maildir_message_t *)msg)->base, maildir_unlink_done, msg ))
+				continue;
+			ctx->close_left--;
+			ret = maildir_unlinked( ctx, dfd, msg, unlinkat( dfd, ((maildir_message_t *)msg)->base, 0 ) ? errno : 0,
+			                        &ctx->close_retry );
+			if (ret != DRV_OK)
+				ctx->close_sts = ret;
+		}
+	if (!--ctx->close_left)
+		maildir_close_finish( ctx );
+}
+#endif /* USE_URING */
+
 static void
 maildir_close( store_t *gctx,
                void (*cb)( int sts, void *aux ), void *aux )
 {
-#ifdef USE_DB
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
-#endif /* USE_DB */
 	message_t *msg;
-	int basel, retry, ret;
-	char buf[_POSIX_PATH_MAX];
+	int retry, ret, dfd;
 
+#ifdef USE_URING
+	if (maildir_uring_setup()) {
+		ctx->close_cb = cb;
+		ctx->close_aux = aux;
+		ctx->close_sts = DRV_OK;
+		maildir_close_round( ctx );
+		return;
+	}
+#endif /* USE_URING */
 	for (;;) {
 		retry = 0;
-		basel = nfsnprintf( buf, sizeof(buf), "%s/", gctx->path );
 		for (msg = gctx->msgs; msg; msg = msg->next)
 			if (!(msg->status & M_DEAD) && (msg->flags & F_DELETED)) {
-				nfsnprintf( buf + basel, sizeof(buf) - basel, "%s/%s", subdirs[msg->status & M_RECENT], ((maildir_message_t *)msg)->base );
-				if (unlink( buf )) {
-					if (errno == ENOENT)
-						retry = 1;
-					else
-						sys_error( "Maildir error: cannot remove %s", buf );
-				} else {
-					msg->status |= M_DEAD;
-					gctx->count--;
-#ifdef USE_DB
-					if (ctx->db && (ret = maildir_purge_msg( ctx, ((maildir_message_t *)msg)->base )) != DRV_OK) {
-						cb( ret, aux );
-						return;
-					}
-#endif /* USE_DB */
+				dfd = ctx->dfds[msg->status & M_RECENT];
+				if ((ret = maildir_unlinked( ctx, dfd, msg, unlinkat( dfd, ((maildir_message_t *)msg)->base, 0 ) ? errno : 0,
+				                             &retry )) != DRV_OK) {
+					cb( ret, aux );
+					return;
 				}
 			}
 		if (!retry) {
@@ -1423,16 +4056,111 @@ maildir_close( store_t *gctx,
 }
 
 static void
-maildir_cancel( store_t *gctx ATTR_UNUSED,
+maildir_cancel( store_t *gctx,
                 void (*cb)( void *aux ), void *aux )
 {
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_flags_op_t *list, *fop;
+	unsigned guard;
+
+	/* Flag changes are not in flight before commit(). */
+	list = ctx->flag_ops;
+	ctx->flag_ops = 0;
+	ctx->flag_ops_append = &ctx->flag_ops;
+	ctx->nflag_ops = 0;
+	guard = maildir_guard_enter( ctx );
+	for (fop = list; fop && !maildir_guard_dead( ctx, guard ); fop = fop->next)
+		fop->cb( DRV_CANCELED, fop->aux );
+	maildir_free_flag_ops( list );
+	/* A delayed load (see maildir_load_p2()) must not complete anymore. */
+	if (ctx->scan_wakeup.slot && !maildir_guard_dead( ctx, guard )) {
+		wipe_wakeup( &ctx->scan_wakeup );
+		ctx->load_cb( DRV_CANCELED, ctx->load_aux );
+	}
+	/* Complete the stores in flight first, like the IMAP driver does. */
+	if (!maildir_guard_dead( ctx, guard ))
+		maildir_flush_stored( gctx );
+	if (!maildir_guard_leave( ctx, guard ))
+		return;
+#ifdef USE_ASYNC
+	/* Their completions come from main_loop(), like all others. */
+	if (ctx->nuops) {
+		ctx->cancel_cb = cb;
+		ctx->cancel_aux = aux;
+		return;
+	}
+#endif /* USE_ASYNC */
 	cb( aux );
 }
 
+static int
+maildir_compare_flag_ops( const void *a, const void *b )
+{
+	const maildir_flags_op_t *fa = *(const maildir_flags_op_t * const *)a;
+	const maildir_flags_op_t *fb = *(const maildir_flags_op_t * const *)b;
+	int ra = fa->msg->gen.status & M_RECENT, rb = fb->msg->gen.status & M_RECENT;
+
+	if (ra != rb)
+		return rb - ra;
+	return strcmp( fa->msg->base, fb->msg->base );
+}
+
+/* Apply the queued flag changes in one pass. The renames are grouped by
+ * directory and done in name order; with io_uring, they are submitted
+ * all at once. */
 static void
 maildir_commit( store_t *gctx )
 {
-	(void) gctx;
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_flags_op_t *fop, **fops;
+	unsigned guard;
+	int i, n, sdfd;
+	char nbuf[_POSIX_PATH_MAX];
+
+	if (!(n = ctx->nflag_ops))
+		return;
+	fops = nfmalloc( n * sizeof(*fops) );
+	for (i = 0, fop = ctx->flag_ops; fop; fop = fop->next)
+		fops[i++] = fop;
+	ctx->flag_ops = 0;
+	ctx->flag_ops_append = &ctx->flag_ops;
+	ctx->nflag_ops = 0;
+	qsort( fops, n, sizeof(*fops), maildir_compare_flag_ops );
+
+	/* The retries must not start before everything was issued. */
+	ctx->flags_left++;
+	guard = maildir_guard_enter( ctx );
+	for (i = 0; i < n; i++) {
+		fop = fops[i];
+		if (maildir_guard_dead( ctx, guard )) {
+			free( fop );
+			continue;
+		}
+		sdfd = ctx->dfds[fop->msg->gen.status & M_RECENT];
+		maildir_flags_name( fop->msg, fop->add, fop->del, nbuf );
+#ifdef USE_URING
+		if (maildir_uring_rename( ctx, sdfd, fop->msg->base, ctx->dfds[0], nbuf, maildir_flags_done, fop )) {
+			ctx->flags_left++;
+			continue;
+		}
+#endif /* USE_URING */
+		if (!renameat( sdfd, fop->msg->base, ctx->dfds[0], nbuf )) {
+			maildir_flags_renamed( fop->msg, nbuf, fop->add, fop->del );
+			fop->cb( DRV_OK, fop->aux );
+		} else if (errno == ENOENT) {
+			fop->next = ctx->flag_retries;
+			ctx->flag_retries = fop;
+			continue;
+		} else {
+			sys_error( "Maildir error: cannot rename %s to %s",
+			           maildir_path( ctx, sdfd, fop->msg->base ), maildir_path( ctx, ctx->dfds[0], nbuf ) );
+			fop->cb( DRV_BOX_BAD, fop->aux );
+		}
+		free( fop );
+	}
+	free( fops );
+	if (maildir_guard_leave( ctx, guard ) && !--ctx->flags_left)
+		maildir_retry_flags( ctx );
 }
 
 static int
@@ -1451,6 +4179,10 @@ maildir_parse_store( conffile_t *cfg, store_conf_t **storep )
 			store->inbox = expand_strdup( cfg->val );
 		else if (!strcasecmp( "Path", cfg->cmd ))
 			store->gen.path = expand_strdup( cfg->val );
+		else if (!strcasecmp( "HardLinks", cfg->cmd ))
+			store->hard_links = parse_bool( cfg );
+		else if (!strcasecmp( "IoUring", cfg->cmd ))
+			store->use_uring = parse_bool( cfg );
 #ifdef USE_DB
 		else if (!strcasecmp( "AltMap", cfg->cmd ))
 			store->alt_map = parse_bool( cfg );
@@ -1477,6 +4209,9 @@ struct driver maildir_driver = {
 	maildir_load,
 	maildir_fetch_msg,
 	maildir_store_msg,
+	maildir_link_msg,
+	maildir_can_copy,
+	maildir_copy_msg,
 	maildir_find_new_msgs,
 	maildir_set_flags,
 	maildir_trash_msg,
@@ -47,6 +47,13 @@
 # define INLINE
 #endif
 
+/* State which belongs to a thread's event loop. */
+#ifdef HAVE___THREAD
+# define THREAD_LOCAL __thread
+#else
+# define THREAD_LOCAL
+#endif
+
 #define EXE "mbsync"
 
 typedef struct ssl_st SSL;
@@ -57,6 +64,7 @@ typedef struct server_conf {
 	char *tunnel;
 	char *host;
 	int port;
+	int timeout; /* seconds; 0 means none */
 #ifdef HAVE_LIBSSL
 	char *cert_file;
 	unsigned use_imaps:1;
@@ -73,6 +81,15 @@ typedef struct server_conf {
 #endif
 } server_conf_t;
 
+typedef struct wakeup {
+	void (*cb)( void *aux );
+	void *aux;
+	time_t sec; /* expiry time on the monotonic clock */
+	int usec;
+	int interval; /* milliseconds; 0 for one-shot timers */
+	int slot; /* position in the timer heap + 1, or 0 if not armed */
+} wakeup_t;
+
 typedef struct buff_chunk {
 	struct buff_chunk *next;
 	char *data;
@@ -100,6 +117,10 @@ typedef struct {
 	} callbacks;
 	void *callback_aux;
 
+	/* deadline for any progress while connecting, or while data is expected */
+	wakeup_t fd_timeout;
+	int expect_read;
+
 	/* writing */
 	buff_chunk_t *write_buf, **write_buf_append; /* buffer head & tail */
 	int write_offset; /* offset into buffer head */
@@ -200,6 +221,7 @@ typedef struct message {
 	int uid;
 	unsigned char flags, status;
 	char tuid[TUIDL];
+	char *msgid; /* server-wide ID (X-GM-MSGID), if any */
 } message_t;
 
 /* For opts, both in store and driver_t->select() */
@@ -229,6 +251,7 @@ typedef struct store {
 	int uidvalidity;
 	int uidnext; /* from SELECT responses */
 	unsigned opts; /* maybe preset? */
+	int size_limit; /* OPEN_SIZE: only sizes above this matter; 0 if unknown */
 	/* note that the following do _not_ reflect stats from msgs, but mailbox totals */
 	int count; /* # of messages */
 	int recent; /* # of recent messages - don't trust this beyond the initial read */
@@ -248,6 +271,8 @@ typedef struct {
 	int len;
 	time_t date;
 	unsigned char flags;
+	const char *msgid; /* see message_t */
+	const char *tuid; /* the TUID in the data, if any */
 } msg_data_t;
 
 #define DRV_OK          0
@@ -325,6 +350,24 @@ struct driver {
 	void (*store_msg)( store_t *ctx, msg_data_t *data, int to_trash,
 	                   void (*cb)( int sts, int uid, void *aux ), void *aux );
 
+	/* Store a copy of a message which was stored into another mailbox of this store
+	 * before, identified by its server-wide ID, without transferring it again.
+	 * DRV_MSG_BAD means that no usable copy is known; store_msg() should be used then. */
+	void (*link_msg)( store_t *ctx, msg_data_t *data, int to_trash,
+	                  void (*cb)( int sts, int uid, void *aux ), void *aux );
+
+	/* Check whether copy_msg() can be used to copy messages to the given store,
+	 * which is driven by the same driver. If tuid is set, the copy must also be
+	 * found by the TUID passed to copy_msg(), should the UID get lost. */
+	int (*can_copy)( store_t *ctx, store_t *dst, int tuid );
+
+	/* Copy the given message from the current mailbox to either the current mailbox
+	 * or the trash folder of the given store without transferring its contents.
+	 * With a date of -1, the copy should keep the message's arrival date; with 0,
+	 * it may get the current time. The new copy's UID is returned like from store_msg(). */
+	void (*copy_msg)( store_t *ctx, message_t *msg, store_t *dst, const char *tuid, int to_trash, int date,
+	                  void (*cb)( int sts, int uid, void *aux ), void *aux );
+
 	/* Index the messages which have newly appeared in the mailbox, including their
 	 * temporary UID headers. This is needed if store_msg() does not guarantee returning
 	 * a UID; otherwise the driver needs to implement only the OPEN_FIND flag. */
@@ -389,6 +432,7 @@ static INLINE void socket_init( conn_t *conn,
 void socket_connect( conn_t *conn, void (*cb)( int ok, void *aux ) );
 void socket_start_tls(conn_t *conn, void (*cb)( int ok, void *aux ) );
 void socket_close( conn_t *sock );
+void socket_expect_read( conn_t *sock, int expect );
 int socket_read( conn_t *sock, char *buf, int len ); /* never waits */
 char *socket_read_line( conn_t *sock ); /* don't free return value; never waits */
 typedef enum { KeepOwn = 0, GiveOwn } ownership_t;
@@ -461,6 +505,14 @@ void add_fd( int fd, void (*cb)( int events, void *aux ), void *aux );
 void conf_fd( int fd, int and_events, int or_events );
 void fake_fd( int fd, int events );
 void del_fd( int fd );
+
+void init_wakeup( wakeup_t *tmr, void (*cb)( void *aux ), void *aux );
+void conf_wakeup( wakeup_t *tmr, int timeout ); /* milliseconds; negative disarms */
+void conf_periodic_wakeup( wakeup_t *tmr, int interval ); /* milliseconds; non-positive disarms */
+void wipe_wakeup( wakeup_t *tmr );
+#define wakeup_armed(tmr) ((tmr)->slot != 0)
+time_t monotonic_time( void ); /* seconds; not affected by setting the clock */
+
 void main_loop( void );
 
 /* sync.c */
@@ -559,8 +559,13 @@ sync_chans( main_vars_t *mvars, int ent )
 			if ((store = mvars->drv[t]->own_store( mvars->chan->stores[t] )))
 				store_opened( store, AUX );
 		}
-		for (t = 0; t < 2 && !mvars->skip; t++)
+		for (t = 0; t < 2; t++)
 			if (mvars->state[t] == ST_FRESH) {
+				if (mvars->skip) {
+					/* The other store failed right away; don't open this one at all. */
+					mvars->state[t] = ST_CLOSED;
+					continue;
+				}
 				info( "Opening %s %s...\n", str_ms[t], mvars->chan->stores[t]->name );
 				mvars->drv[t]->open_store( mvars->chan->stores[t], store_opened, AUX );
 			}
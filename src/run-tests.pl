@@ -18,6 +18,7 @@
 
 use strict;
 use File::Path;
+use POSIX ();
 
 -d "tmp" or mkdir "tmp";
 chdir "tmp" or die "Cannot enter temp direcory.\n";
@@ -231,6 +232,126 @@ my @X51 = (
 );
 test(\@x50, \@X51);
 
+# load exception tests
+
+# Old messages which are flagged on the slave are kept beyond MaxMessages,
+# so the master has to load them as exceptions - thousands of them here,
+# interleaved with expired ones. Some were changed on the master meanwhile.
+my @x60 = ([ 6003 ], [ 6003 ], [ 6003, 6000, 6003 ]);
+my @X61 = ([ "", "", "MaxMessages 3\n" ], [ 6003 ], [ 6003 ], [ 6003, 6000, 6003 ]);
+for my $i (1 .. 6003) {
+	if ($i > 6000 || ($i & 1)) {
+		my $f = $i > 6000 ? "" : "F";
+		my $mf = ($i % 4 == 1) ? "FS" : $f;
+		push @{ $x60[0] }, $i, $i, $mf;
+		push @{ $x60[1] }, $i, $i, $f;
+		push @{ $x60[2] }, $i, $i, $f;
+		push @{ $X61[1] }, $i, $i, $mf;
+		push @{ $X61[2] }, $i, $i, $mf;
+		push @{ $X61[3] }, $i, $i, $mf;
+	} else {
+		push @{ $x60[0] }, $i, $i, "";
+		push @{ $x60[2] }, $i, $i, "X";
+		push @{ $X61[1] }, $i, $i, "";
+	}
+}
+test(\@x60, \@X61);
+
+# bulk delivery tests
+
+# Enough messages of different sizes that the deliveries are synced to disk
+# in batches, and that the worker threads complete them out of order. So the
+# slave's UIDs may be in a different order; only the pairing is checked.
+my @x70 = ([ 300 ], [ 0 ], [ 0, 0, 0 ]);
+for my $i (1 .. 300) {
+	push @{ $x70[0] }, $i, $i, ($i % 3) ? "" : "*";
+}
+{
+	&mkchan($x70[0], $x70[1], @{ $x70[2] });
+	&writecfg("", "", "", "FSync Normal\n");
+	my ($xc, @ret) = &runsync("");
+	my $err = $xc ? "mbsync failed.\n" : "";
+	if (!$err) {
+		my ($mmu, %mms) = &readbox("master");
+		my ($smu, %sms) = &readbox("slave");
+		my %snum = map { $sms{$_}[0] => $_ } keys(%sms);
+		open(FILE, "<", "slave/.mbsyncstate") or die "Cannot read sync state.\n";
+		my $hdr = <FILE>;
+		chomp(my @ls = <FILE>);
+		close FILE;
+		if ($hdr ne "1:300 1:0:0\n" || $smu != 300 || keys(%snum) != 300 || @ls != 300) {
+			$err = "Wrong number of messages.\n";
+		}
+		for my $l (@ls) {
+			my ($mu, $su) = split(/ /, $l);
+			my $n = $snum{$su};
+			if (!defined($n) || $mms{$n}[0] != $mu || $mms{$n}[1] ne $sms{$n}[1]) {
+				$err = "Bad pair $mu $su.\n";
+				last;
+			}
+		}
+	}
+	&killcfg();
+	if ($err) {
+		print $err;
+		print "Debug output:\n";
+		print @ret;
+		exit 1;
+	}
+	rmtree "slave";
+	rmtree "master";
+}
+
+# concurrent modification tests
+
+# Flag changes are queued and applied in one pass at the end, while another
+# MUA marks the same messages as replied. Either side's renames may fail, so
+# both have to find the messages again. The result is settled by a second run.
+my @x80 = ([ 1000 ], [ 1000 ], [ 1000, 0, 1000 ]);
+my @X81 = ([ "", "", "" ], [ 1000 ], [ 1000 ], [ 1000, 0, 1000 ]);
+for my $i (1 .. 1000) {
+	push @{ $x80[0] }, $i, $i, "";
+	push @{ $x80[1] }, $i, $i, "F";
+	push @{ $x80[2] }, $i, $i, "";
+	push @{ $X81[1] }, $i, $i, "FR";
+	push @{ $X81[2] }, $i, $i, "FR";
+	push @{ $X81[3] }, $i, $i, "FR";
+}
+&mkchan($x80[0], $x80[1], @{ $x80[2] });
+&writecfg(@{ $X81[0] });
+my $pid = fork();
+defined($pid) or die "Cannot fork.\n";
+if (!$pid) {
+	for (my $busy = 1, my $n = 0; $busy && $n < 100; $n++) {
+		$busy = 0;
+		opendir(DIR, "master/cur") or POSIX::_exit(1);
+		for my $f (readdir(DIR)) {
+			my ($bn, $fl) = ($f =~ /^(.+):2,([A-Z]*)$/) or next;
+			next if ($fl =~ /R/);
+			$busy = 1;
+			rename("master/cur/".$f, "master/cur/".$bn.":2,".join("", sort(split(//, $fl."R"))));
+		}
+		closedir(DIR);
+	}
+	POSIX::_exit(0);
+}
+my ($xc, @ret) = &runsync("");
+waitpid($pid, 0);
+if (!$xc) {
+	($xc, @ret) = &runsync("");
+}
+&killcfg();
+if ($xc || &ckstate("slave/.mbsyncstate", @{ $X81[3] }) |
+    &ckbox("master", @{ $X81[1] }) | &ckbox("slave", @{ $X81[2] })) {
+	print "Expected result:\n";
+	&printchan($X81[1], $X81[2], @{ $X81[3] });
+	print "Debug output:\n";
+	print @ret;
+	exit 1;
+}
+rmtree "slave";
+rmtree "master";
+
 
 ################################################################################
 
@@ -250,14 +371,14 @@ sub qm($)
 	return $_;
 }
 
-# $global, $master, $slave
-sub writecfg($$$)
+# $master, $slave, $channel[, $global]
+sub writecfg($$$;$)
 {
+	my $global = defined($_[3]) ? $_[3] : "FSync None\n";
 	open(FILE, ">", ".mbsyncrc") or
 		die "Cannot open .mbsyncrc.\n";
 	print FILE
-"FSync None
-
+$global."
 MaildirStore master
 Path ./
 Inbox ./master
@@ -307,11 +428,11 @@ sub readbox($)
 	for my $d ("cur", "new") {
 		opendir(DIR, $bn."/".$d) or next;
 		for my $f (grep(!/^\.\.?$/, readdir(DIR))) {
-			my ($uid, $flg, $num);
-			if ($f =~ /^\d+\.\d+_\d+\.[-[:alnum:]]+,U=(\d+):2,(.*)$/) {
-				($uid, $flg) = ($1, $2);
-			} elsif ($f =~ /^\d+\.\d+_(\d+)\.[-[:alnum:]]+:2,(.*)$/) {
-				($uid, $flg) = (0, $2);
+			my ($uid, $flg, $fsz, $num);
+			if ($f =~ /^\d+\.\d+_\d+\.[-[:alnum:]]+(?:,S=(\d+))?,U=(\d+):2,(.*)$/) {
+				($fsz, $uid, $flg) = ($1, $2, $3);
+			} elsif ($f =~ /^\d+\.\d+_(\d+)\.[-[:alnum:]]+(?:,S=(\d+))?:2,(.*)$/) {
+				($fsz, $uid, $flg) = ($2, 0, $3);
 			} else {
 				print STDERR "unrecognided file name '$f' in '$bn'.\n";
 				exit 1;
@@ -323,6 +444,10 @@ sub readbox($)
 				$sz += length($_);
 			}
 			close FILE;
+			if (defined($fsz) && $fsz != $sz) {
+				print STDERR "message '$f' in '$bn' has wrong size $sz.\n";
+				exit 1;
+			}
 			if (!defined($num)) {
 				print STDERR "message '$f' in '$bn' has no identifier.\n";
 				exit 1;
@@ -29,6 +29,9 @@
 # include <openssl/err.h>
 # include <openssl/hmac.h>
 # include <openssl/x509v3.h>
+# ifdef HAVE_PTHREAD
+#  include <pthread.h>
+# endif
 #endif
 
 #include "isync.h"
@@ -61,8 +64,14 @@ socket_fail( conn_t *conn )
 	conn->bad_callback( conn->callback_aux );
 }
 
+static void socket_arm_timeout( conn_t * );
+
 #ifdef HAVE_LIBSSL
 static int ssl_data_idx;
+#ifdef HAVE_PTHREAD
+/* The library and each server's context are set up once per process. */
+static pthread_mutex_t ssl_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif /* HAVE_PTHREAD */
 
 static int
 ssl_return( const char *func, conn_t *conn, int ret )
@@ -249,17 +258,25 @@ void
 socket_start_tls( conn_t *conn, void (*cb)( int ok, void *aux ) )
 {
 	static int ssl_inited;
+	int ok;
 
 	conn->callbacks.starttls = cb;
 
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock( &ssl_lock );
+#endif /* HAVE_PTHREAD */
 	if (!ssl_inited) {
 		SSL_library_init();
 		SSL_load_error_strings();
 		ssl_data_idx = SSL_get_ex_new_index( 0, NULL, NULL, NULL, NULL );
 		ssl_inited = 1;
 	}
+	ok = init_ssl_ctx( conn->conf );
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock( &ssl_lock );
+#endif /* HAVE_PTHREAD */
 
-	if (!init_ssl_ctx( conn->conf )) {
+	if (!ok) {
 		start_tls_p3( conn, 0 );
 		return;
 	}
@@ -269,6 +286,7 @@ socket_start_tls( conn_t *conn, void (*cb)( int ok, void *aux ) )
 	SSL_set_mode( conn->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER );
 	SSL_set_ex_data( conn->ssl, ssl_data_idx, conn );
 	conn->state = SCK_STARTTLS;
+	socket_arm_timeout( conn );
 	start_tls_p2( conn );
 }
 
@@ -289,20 +307,44 @@ start_tls_p2( conn_t *conn )
 static void start_tls_p3( conn_t *conn, int ok )
 {
 	conn->state = SCK_READY;
+	socket_arm_timeout( conn );
 	conn->callbacks.starttls( ok, conn->callback_aux );
 }
 
 #endif /* HAVE_LIBSSL */
 
 static void socket_fd_cb( int, void * );
+static void socket_timeout( void * );
 
 static void socket_connect_failed( conn_t * );
 static void socket_connected( conn_t * );
 static void socket_connect_bail( conn_t * );
 
+/* A connection which is expected to make progress gets a deadline, which
+ * is pushed back whenever it does. An idle connection may stay idle. */
+static void
+socket_arm_timeout( conn_t *conn )
+{
+	if (conn->conf->timeout > 0 &&
+	    (conn->state != SCK_READY || conn->expect_read || conn->write_buf))
+		conf_wakeup( &conn->fd_timeout, conn->conf->timeout * 1000 );
+	else
+		wipe_wakeup( &conn->fd_timeout );
+}
+
+void
+socket_expect_read( conn_t *conn, int expect )
+{
+	if (conn->expect_read != expect) {
+		conn->expect_read = expect;
+		socket_arm_timeout( conn );
+	}
+}
+
 static void
 socket_close_internal( conn_t *sock )
 {
+	wipe_wakeup( &sock->fd_timeout );
 	del_fd( sock->fd );
 	close( sock->fd );
 	sock->fd = -1;
@@ -317,6 +359,8 @@ socket_connect( conn_t *sock, void (*cb)( int ok, void *aux ) )
 	int s, a[2];
 
 	sock->callbacks.connect = cb;
+	init_wakeup( &sock->fd_timeout, socket_timeout, sock );
+	sock->expect_read = 0;
 
 	/* open connection to IMAP server */
 	if (conf->tunnel) {
@@ -382,6 +426,7 @@ socket_connect( conn_t *sock, void (*cb)( int ok, void *aux ) )
 			}
 			conf_fd( s, 0, POLLOUT );
 			sock->state = SCK_CONNECTING;
+			socket_arm_timeout( sock );
 			info( "\v\n" );
 			return;
 		}
@@ -405,6 +450,7 @@ socket_connected( conn_t *conn )
 {
 	conf_fd( conn->fd, 0, POLLIN );
 	conn->state = SCK_READY;
+	socket_arm_timeout( conn );
 	conn->callbacks.connect( 1, conn->callback_aux );
 }
 
@@ -468,6 +514,7 @@ socket_fill( conn_t *sock )
 		}
 	}
 	sock->bytes += n;
+	socket_arm_timeout( sock );
 	sock->read_callback( sock->callback_aux );
 }
 
@@ -537,6 +584,8 @@ do_write( conn_t *sock, char *buf, int len )
 	} else if (n != len) {
 		conf_fd( sock->fd, POLLIN, POLLOUT );
 	}
+	if (n > 0)
+		socket_arm_timeout( sock );
 	return n;
 }
 
@@ -570,6 +619,7 @@ do_queued_write( conn_t *conn )
 		conn->write_offset = 0;
 		dispose_chunk( conn );
 	}
+	socket_arm_timeout( conn );
 #ifdef HAVE_LIBSSL
 	if (conn->ssl && SSL_pending( conn->ssl ))
 		fake_fd( conn->fd, POLLIN );
@@ -607,6 +657,7 @@ socket_write( conn_t *conn, char *buf, int len, ownership_t takeOwn )
 		if (n != len && n >= 0) {
 			conn->write_offset = n;
 			do_append( conn, buf, len, takeOwn );
+			socket_arm_timeout( conn );
 		} else if (takeOwn) {
 			free( buf );
 		}
@@ -661,6 +712,26 @@ socket_fd_cb( int events, void *aux )
 		socket_fill( conn );
 }
 
+static void
+socket_timeout( void *aux )
+{
+	conn_t *conn = (conn_t *)aux;
+
+	if (conn->state == SCK_CONNECTING) {
+		errno = ETIMEDOUT;
+		socket_connect_failed( conn );
+		return;
+	}
+	error( "Socket error on %s: timeout.\n", conn->name );
+#ifdef HAVE_LIBSSL
+	if (conn->state == SCK_STARTTLS) {
+		start_tls_p3( conn, 0 );
+		return;
+	}
+#endif
+	socket_fail( conn );
+}
+
 #ifdef HAVE_LIBSSL
 /* this isn't strictly socket code, but let's have all OpenSSL use in one file. */
 
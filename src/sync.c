@@ -157,6 +157,7 @@ typedef struct {
 	int uidval[2]; /* UID validity value */
 	int newuid[2]; /* TUID lookup makes sense only for UIDs >= this */
 	int smaxxuid; /* highest expired UID on slave */
+	int cols; /* width of each half of the progress counter */
 } sync_vars_t;
 
 static void sync_ref( sync_vars_t *svars ) { ++svars->ref_count; }
@@ -272,7 +273,10 @@ typedef struct copy_vars {
 	msg_data_t data;
 } copy_vars_t;
 
+static int copy_msg_p2( copy_vars_t *vars );
+static void msg_linked( int sts, int uid, void *aux );
 static void msg_fetched( int sts, void *aux );
+static void msg_stored( int sts, int uid, void *aux );
 
 static int
 copy_msg( copy_vars_t *vars )
@@ -280,12 +284,45 @@ copy_msg( copy_vars_t *vars )
 	DECL_INIT_SVARS(vars->aux);
 
 	t ^= 1;
+	/* If both boxes live in the same place, there may be no need to transfer the
+	 * contents. However, the journal records only the TUID before the copy is made,
+	 * so if we are interrupted before the UID is journaled, the next run finds the
+	 * copy only if the driver records the TUID along with it. Otherwise, the message
+	 * would be propagated again, so the copy is made the slow way then. */
+	if (svars->drv[t] == svars->drv[1-t] && svars->drv[t]->can_copy( svars->ctx[t], svars->ctx[1-t], vars->srec != 0 ))
+		DRIVER_CALL_RET(copy_msg( svars->ctx[t], vars->msg, svars->ctx[1-t], vars->srec ? vars->srec->tuid : 0,
+		                          !vars->srec, svars->chan->use_internal_date ? -1 : 0, msg_stored, vars ));
 	vars->data.flags = vars->msg->flags;
 	vars->data.date = svars->chan->use_internal_date ? -1 : 0;
+	vars->data.msgid = vars->msg->msgid;
+	vars->data.tuid = vars->srec ? vars->srec->tuid : 0;
+	if (vars->msg->msgid) {
+		/* The message may be already present in another box of the target store. */
+		t ^= 1;
+		DRIVER_CALL_RET(link_msg( svars->ctx[t], &vars->data, !vars->srec, msg_linked, vars ));
+	}
+	return copy_msg_p2( vars );
+}
+
+static int
+copy_msg_p2( copy_vars_t *vars )
+{
+	DECL_INIT_SVARS(vars->aux);
+
+	t ^= 1;
 	DRIVER_CALL_RET(fetch_msg( svars->ctx[t], vars->msg, &vars->data, msg_fetched, vars ));
 }
 
-static void msg_stored( int sts, int uid, void *aux );
+static void
+msg_linked( int sts, int uid, void *aux )
+{
+	copy_vars_t *vars = (copy_vars_t *)aux;
+
+	if (sts == DRV_MSG_BAD)
+		copy_msg_p2( vars );
+	else
+		msg_stored( sts, uid, vars );
+}
 
 static void
 msg_fetched( int sts, void *aux )
@@ -453,12 +490,8 @@ static void
 stats( sync_vars_t *svars )
 {
 	char buf[2][64];
-	char *cs;
-	int t, l;
-	static int cols = -1;
+	int t, l, cols = svars->cols;
 
-	if (cols < 0 && (!(cs = getenv( "COLUMNS" )) || !(cols = atoi( cs ) / 2)))
-		cols = 36;
 	if (!(DFlags & QUIET)) {
 		for (t = 0; t < 2; t++) {
 			l = sprintf( buf[t], "+%d/%d *%d/%d #%d/%d",
@@ -601,6 +634,7 @@ sync_boxes( store_t *ctx[], const char *names[], channel_conf_t *chan,
             void (*cb)( int sts, void *aux ), void *aux )
 {
 	sync_vars_t *svars;
+	char *cs;
 	int t;
 
 	svars = nfcalloc( sizeof(*svars) );
@@ -613,6 +647,8 @@ sync_boxes( store_t *ctx[], const char *names[], channel_conf_t *chan,
 	svars->chan = chan;
 	svars->uidval[0] = svars->uidval[1] = -1;
 	svars->srecadd = &svars->srecs;
+	if (!(cs = getenv( "COLUMNS" )) || (svars->cols = atoi( cs ) / 2) <= 0)
+		svars->cols = 36;
 
 	for (t = 0; t < 2; t++) {
 		ctx[t]->orig_name =
@@ -946,8 +982,10 @@ box_selected( int sts, void *aux )
 				opts[1-t] |= OPEN_NEW;
 			if (chan->ops[t] & OP_EXPUNGE)
 				opts[1-t] |= OPEN_FLAGS;
-			if (chan->stores[t]->max_size != INT_MAX)
+			if (chan->stores[t]->max_size != INT_MAX) {
 				opts[1-t] |= OPEN_SIZE;
+				ctx[1-t]->size_limit = chan->stores[t]->max_size;
+			}
 		}
 		if (chan->ops[t] & OP_EXPUNGE) {
 			opts[t] |= OPEN_EXPUNGE;
@@ -1071,7 +1109,11 @@ box_loaded( int sts, void *aux )
 		uid = tmsg->uid;
 		if (DFlags & DEBUG) {
 			make_flags( tmsg->flags, fbuf );
-			printf( svars->ctx[t]->opts & OPEN_SIZE ? "  message %5d, %-4s, %6lu: " : "  message %5d, %-4s: ", uid, fbuf, tmsg->size );
+			/* With a size limit, the driver may know only the sizes above it. */
+			if ((svars->ctx[t]->opts & OPEN_SIZE) && (tmsg->size || !svars->ctx[t]->size_limit))
+				printf( "  message %5d, %-4s, %6lu: ", uid, fbuf, tmsg->size );
+			else
+				printf( "  message %5d, %-4s: ", uid, fbuf );
 		}
 		idx = (unsigned)((unsigned)uid * 1103515245U) % hashsz;
 		while (srecmap[idx].uid) {
@@ -1378,7 +1420,8 @@ box_loaded( int sts, void *aux )
 		}
 	}
 	for (t = 0; t < 2; t++) {
-		svars->drv[t]->commit( svars->ctx[t] );
+		/* The commit may report the flag changes right away. */
+		DRIVER_CALL(commit( svars->ctx[t] ));
 		svars->state[t] |= ST_SENT_FLAGS;
 		if (msgs_flags_set( svars, t ))
 			return;
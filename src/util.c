@@ -28,6 +28,8 @@
 #include <fcntl.h>
 #include <string.h>
 #include <pwd.h>
+#include <sys/time.h>
+#include <time.h>
 
 int DFlags;
 static int need_nl;
@@ -176,6 +178,7 @@ free_generic_messages( message_t *msgs )
 
 	for (; msgs; msgs = tmsg) {
 		tmsg = msgs->next;
+		free( msgs->msgid );
 		free( msgs );
 	}
 }
@@ -395,8 +398,10 @@ sort_ints( int *arr, int len )
 }
 
 
-static struct {
+/* Each thread gets its own generator, seeded on first use. */
+static THREAD_LOCAL struct {
 	unsigned char i, j, s[256];
+	int seeded;
 } rs;
 
 void
@@ -424,6 +429,7 @@ arc4_init( void )
 		rs.s[j] = si;
 	}
 	rs.i = rs.j = 0;
+	rs.seeded = 1;
 
 	for (i = 0; i < 256; i++)
 		arc4_getbyte();
@@ -434,6 +440,8 @@ arc4_getbyte( void )
 {
 	unsigned char si, sj;
 
+	if (!rs.seeded)
+		arc4_init();
 	rs.i++;
 	si = rs.s[rs.i];
 	rs.j += si;
@@ -462,45 +470,84 @@ bucketsForSize( int size )
 	}
 }
 
-#ifdef HAVE_SYS_POLL_H
-static struct pollfd *pollfds;
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+/* epoll() reports only the descriptors which are ready, so waiting
+ * doesn't get slower with the number of connections. */
+# define USE_EPOLL
+static THREAD_LOCAL int epfd = -1;
+static THREAD_LOCAL int *fakefds, nfakefds, rfakefds; /* may contain stale entries */
+#endif
+
+#if defined(HAVE_SYS_POLL_H) && !defined(USE_EPOLL)
+static THREAD_LOCAL struct pollfd *pollfds;
 #else
-# ifdef HAVE_SYS_SELECT_H
+# if !defined(HAVE_SYS_POLL_H) && defined(HAVE_SYS_SELECT_H)
 #  include <sys/select.h>
 # endif
 # define pollfds fdparms
 #endif
-static struct {
+static THREAD_LOCAL struct {
 	void (*cb)( int what, void *aux );
 	void *aux;
-#ifndef HAVE_SYS_POLL_H
+#if !defined(HAVE_SYS_POLL_H) || defined(USE_EPOLL)
 	int fd, events;
 #endif
 	int faked;
 } *fdparms;
-static int npolls, rpolls, changed;
+static THREAD_LOCAL int npolls, rpolls, changed, nfaked;
+static THREAD_LOCAL int *fdslots, nfdslots; /* fd => index into fdparms + 1 */
 
 static int
 find_fd( int fd )
 {
-	int n;
+	return fd < nfdslots ? fdslots[fd] - 1 : -1;
+}
 
-	for (n = 0; n < npolls; n++)
-		if (pollfds[n].fd == fd)
-			return n;
-	return -1;
+#ifdef USE_EPOLL
+static void
+epoll_init( void )
+{
+	if (epfd < 0 && (epfd = epoll_create1( EPOLL_CLOEXEC )) < 0) {
+		perror( "epoll_create1() failed in event loop" );
+		abort();
+	}
 }
 
+static void
+epoll_conf( int op, int fd, int events )
+{
+	struct epoll_event ev;
+
+	ev.events = ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+	ev.data.fd = fd;
+	if (epoll_ctl( epfd, op, fd, &ev )) {
+		perror( "epoll_ctl() failed in event loop" );
+		abort();
+	}
+}
+#endif
+
 void
 add_fd( int fd, void (*cb)( int events, void *aux ), void *aux )
 {
 	int n;
 
 	assert( find_fd( fd ) < 0 );
+	if (fd >= nfdslots) {
+		n = nfdslots;
+		nfdslots = fd + 16;
+		fdslots = nfrealloc( fdslots, nfdslots * sizeof(*fdslots) );
+		memset( fdslots + n, 0, (nfdslots - n) * sizeof(*fdslots) );
+	}
+#ifdef USE_EPOLL
+	epoll_init();
+	epoll_conf( EPOLL_CTL_ADD, fd, 0 );
+#endif
 	n = npolls++;
 	if (rpolls < npolls) {
 		rpolls = npolls;
-#ifdef HAVE_SYS_POLL_H
+#if defined(HAVE_SYS_POLL_H) && !defined(USE_EPOLL)
 		pollfds = nfrealloc(pollfds, npolls * sizeof(*pollfds));
 #endif
 		fdparms = nfrealloc(fdparms, npolls * sizeof(*fdparms));
@@ -510,6 +557,7 @@ add_fd( int fd, void (*cb)( int events, void *aux ), void *aux )
 	fdparms[n].faked = 0;
 	fdparms[n].cb = cb;
 	fdparms[n].aux = aux;
+	fdslots[fd] = n + 1;
 	changed = 1;
 }
 
@@ -517,8 +565,15 @@ void
 conf_fd( int fd, int and_events, int or_events )
 {
 	int n = find_fd( fd );
+	int events;
+
 	assert( n >= 0 );
-	pollfds[n].events = (pollfds[n].events & and_events) | or_events;
+	events = (pollfds[n].events & and_events) | or_events;
+#ifdef USE_EPOLL
+	if (events != pollfds[n].events)
+		epoll_conf( EPOLL_CTL_MOD, fd, events );
+#endif
+	pollfds[n].events = events;
 }
 
 void
@@ -526,22 +581,218 @@ fake_fd( int fd, int events )
 {
 	int n = find_fd( fd );
 	assert( n >= 0 );
+	if (!fdparms[n].faked) {
+		nfaked++;
+#ifdef USE_EPOLL
+		if (nfakefds == rfakefds) {
+			rfakefds = rfakefds * 2 + 16;
+			fakefds = nfrealloc( fakefds, rfakefds * sizeof(*fakefds) );
+		}
+		fakefds[nfakefds++] = fd;
+#endif
+	}
 	fdparms[n].faked |= events;
 }
 
 void
 del_fd( int fd )
 {
+#ifdef USE_EPOLL
+	struct epoll_event ev;
+#endif
 	int n = find_fd( fd );
+
 	assert( n >= 0 );
-	npolls--;
-#ifdef HAVE_SYS_POLL_H
-	memmove(pollfds + n, pollfds + n + 1, (npolls - n) * sizeof(*pollfds));
+#ifdef USE_EPOLL
+	/* Fails if the descriptor was closed already, which is harmless. */
+	epoll_ctl( epfd, EPOLL_CTL_DEL, fd, &ev );
 #endif
-	memmove(fdparms + n, fdparms + n + 1, (npolls - n) * sizeof(*fdparms));
+	if (fdparms[n].faked)
+		nfaked--;
+	fdslots[fd] = 0;
+	/* Fill the gap with the last entry, so this doesn't need to move everything. */
+	if (n != --npolls) {
+#if defined(HAVE_SYS_POLL_H) && !defined(USE_EPOLL)
+		pollfds[n] = pollfds[npolls];
+#endif
+		fdparms[n] = fdparms[npolls];
+		fdslots[pollfds[n].fd] = n + 1;
+	}
 	changed = 1;
 }
 
+/* The armed timers form a binary min-heap ordered by expiry, so arming,
+ * disarming and firing them is logarithmic in their number.
+ * Periodic timers are counted separately, as they alone do not keep
+ * main_loop() running - there would be nothing left for them to watch. */
+static THREAD_LOCAL wakeup_t **timers;
+static THREAD_LOCAL int ntimers, rtimers, nperiodic;
+
+/* The expiry times are monotonic, so setting the clock affects no timeout. */
+static void
+get_now( time_t *sec, int *usec )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	*sec = ts.tv_sec;
+	*usec = ts.tv_nsec / 1000;
+}
+
+time_t
+monotonic_time( void )
+{
+	time_t sec;
+	int usec;
+
+	get_now( &sec, &usec );
+	return sec;
+}
+
+static int
+wakeup_before( wakeup_t *a, wakeup_t *b )
+{
+	return a->sec < b->sec || (a->sec == b->sec && a->usec < b->usec);
+}
+
+static void
+place_wakeup( wakeup_t *tmr, int n )
+{
+	int p, c;
+
+	/* Move up towards the root ... */
+	for (; n && wakeup_before( tmr, timers[p = (n - 1) / 2] ); n = p) {
+		timers[n] = timers[p];
+		timers[n]->slot = n + 1;
+	}
+	/* ... or down towards the leaves. */
+	for (; (c = 2 * n + 1) < ntimers; n = c) {
+		if (c + 1 < ntimers && wakeup_before( timers[c + 1], timers[c] ))
+			c++;
+		if (!wakeup_before( timers[c], tmr ))
+			break;
+		timers[n] = timers[c];
+		timers[n]->slot = n + 1;
+	}
+	timers[n] = tmr;
+	tmr->slot = n + 1;
+}
+
+static void
+arm_wakeup( wakeup_t *tmr, time_t sec, int usec, int timeout )
+{
+	tmr->sec = sec + timeout / 1000;
+	tmr->usec = usec + timeout % 1000 * 1000;
+	if (tmr->usec >= 1000000) {
+		tmr->sec++;
+		tmr->usec -= 1000000;
+	}
+	if (ntimers == rtimers) {
+		rtimers = rtimers * 2 + 16;
+		timers = nfrealloc( timers, rtimers * sizeof(*timers) );
+	}
+	if (tmr->interval)
+		nperiodic++;
+	ntimers++;
+	place_wakeup( tmr, ntimers - 1 );
+}
+
+void
+init_wakeup( wakeup_t *tmr, void (*cb)( void *aux ), void *aux )
+{
+	tmr->cb = cb;
+	tmr->aux = aux;
+	tmr->interval = 0;
+	tmr->slot = 0;
+}
+
+void
+wipe_wakeup( wakeup_t *tmr )
+{
+	int n;
+
+	if (!tmr->slot)
+		return;
+	n = tmr->slot - 1;
+	tmr->slot = 0;
+	if (tmr->interval)
+		nperiodic--;
+	if (n != --ntimers)
+		place_wakeup( timers[ntimers], n );
+}
+
+void
+conf_wakeup( wakeup_t *tmr, int timeout )
+{
+	time_t sec;
+	int usec;
+
+	wipe_wakeup( tmr );
+	tmr->interval = 0;
+	if (timeout < 0)
+		return;
+	get_now( &sec, &usec );
+	arm_wakeup( tmr, sec, usec, timeout );
+}
+
+void
+conf_periodic_wakeup( wakeup_t *tmr, int interval )
+{
+	time_t sec;
+	int usec;
+
+	wipe_wakeup( tmr );
+	if (interval <= 0) {
+		tmr->interval = 0;
+		return;
+	}
+	tmr->interval = interval;
+	get_now( &sec, &usec );
+	arm_wakeup( tmr, sec, usec, interval );
+}
+
+/* Milliseconds until the next wakeup is due, or -1 if there is none. */
+static int
+next_wakeup( void )
+{
+	time_t sec;
+	int usec;
+	long secs;
+
+	if (!ntimers)
+		return -1;
+	get_now( &sec, &usec );
+	secs = timers[0]->sec - sec;
+	if (secs < 0)
+		return 0;
+	if (secs > 1000000)
+		return 1000000000;
+	secs = secs * 1000 + (timers[0]->usec - usec + 999) / 1000;
+	return secs < 0 ? 0 : secs;
+}
+
+static void
+fire_wakeups( void )
+{
+	wakeup_t *tmr;
+	time_t sec;
+	int usec;
+
+	get_now( &sec, &usec );
+	while (ntimers && ((tmr = timers[0])->sec < sec || (tmr->sec == sec && tmr->usec <= usec))) {
+		wipe_wakeup( tmr );
+		if (tmr->interval) {
+			/* Keep the period stable, unless we fell behind by more than that. */
+			arm_wakeup( tmr, tmr->sec, tmr->usec, tmr->interval );
+			if (tmr->sec < sec || (tmr->sec == sec && tmr->usec <= usec)) {
+				wipe_wakeup( tmr );
+				arm_wakeup( tmr, sec, usec, tmr->interval );
+			}
+		}
+		tmr->cb( tmr->aux );
+	}
+}
+
 #define shifted_bit(in, from, to) \
 	(((unsigned)(in) & from) \
 		/ (from > to ? from / to : 1) \
@@ -552,21 +803,62 @@ event_wait( void )
 {
 	int m, n;
 
-#ifdef HAVE_SYS_POLL_H
-	int timeout = -1;
-	for (n = 0; n < npolls; n++)
-		if (fdparms[n].faked) {
-			timeout = 0;
-			break;
+#ifdef USE_EPOLL
+	struct epoll_event evs[64];
+	int i, fd, nevs;
+
+	epoll_init(); /* There may be only timers. */
+	if ((nevs = epoll_wait( epfd, evs, 64, nfaked ? 0 : next_wakeup() )) < 0) {
+		perror( "epoll_wait() failed in event loop" );
+		abort();
+	}
+	changed = 0;
+	for (i = 0; i < nevs; i++) {
+		n = find_fd( evs[i].data.fd );
+		m = fdparms[n].faked;
+		if (m) {
+			fdparms[n].faked = 0;
+			nfaked--;
+		}
+		if (evs[i].events & EPOLLIN)
+			m |= POLLIN;
+		if (evs[i].events & EPOLLOUT)
+			m |= POLLOUT;
+		if (evs[i].events & EPOLLERR)
+			m |= POLLERR;
+		if (evs[i].events & EPOLLHUP)
+			m |= POLLHUP | POLLIN;
+		fdparms[n].cb( m, fdparms[n].aux );
+		if (changed) {
+			/* The remaining events may refer to reused descriptors. */
+			changed = 0;
+			goto out;
+		}
+	}
+	/* Entries added by the callbacks are left for the next round. */
+	for (i = 0, nevs = nfakefds; i < nevs; i++) {
+		fd = fakefds[i];
+		if ((n = find_fd( fd )) >= 0 && (m = fdparms[n].faked)) {
+			fdparms[n].faked = 0;
+			nfaked--;
+			fdparms[n].cb( m, fdparms[n].aux );
 		}
-	if (poll( pollfds, npolls, timeout ) < 0) {
+	}
+	nfakefds -= nevs;
+	memmove( fakefds, fakefds + nevs, nfakefds * sizeof(*fakefds) );
+  out:
+#elif defined(HAVE_SYS_POLL_H)
+	if (poll( pollfds, npolls, nfaked ? 0 : next_wakeup() ) < 0) {
 		perror( "poll() failed in event loop" );
 		abort();
 	}
 	for (n = 0; n < npolls; n++)
 		if ((m = pollfds[n].revents | fdparms[n].faked)) {
 			assert( !(m & POLLNVAL) );
-			fdparms[n].faked = 0;
+			if (fdparms[n].faked) {
+				fdparms[n].faked = 0;
+				nfaked--;
+			}
 			fdparms[n].cb( m | shifted_bit( m, POLLHUP, POLLIN ), fdparms[n].aux );
 			if (changed) {
 				changed = 0;
@@ -575,17 +867,23 @@ event_wait( void )
 		}
 #else
 	struct timeval *timeout = 0;
-	static struct timeval null_tv;
+	static THREAD_LOCAL struct timeval null_tv, wake_tv;
 	fd_set rfds, wfds, efds;
 	int fd;
 
+	if (nfaked)
+		timeout = &null_tv;
+	else if ((n = next_wakeup()) >= 0) {
+		wake_tv.tv_sec = n / 1000;
+		wake_tv.tv_usec = n % 1000 * 1000;
+		timeout = &wake_tv;
+	}
+
 	FD_ZERO( &rfds );
 	FD_ZERO( &wfds );
 	FD_ZERO( &efds );
 	m = -1;
 	for (n = 0; n < npolls; n++) {
-		if (fdparms[n].faked)
-			timeout = &null_tv;
 		fd = fdparms[n].fd;
 		if (fdparms[n].events & POLLIN)
 			FD_SET( fd, &rfds );
@@ -609,7 +907,10 @@ event_wait( void )
 		if (FD_ISSET( fd, &efds ))
 			m |= POLLERR;
 		if (m) {
-			fdparms[n].faked = 0;
+			if (fdparms[n].faked) {
+				fdparms[n].faked = 0;
+				nfaked--;
+			}
 			fdparms[n].cb( m, fdparms[n].aux );
 			if (changed) {
 				changed = 0;
@@ -618,11 +919,12 @@ event_wait( void )
 		}
 	}
 #endif
+	fire_wakeups();
 }
 
 void
 main_loop( void )
 {
-	while (npolls)
+	while (npolls || ntimers > nperiodic)
 		event_wait();
 }